@@ -0,0 +1,100 @@
+// Expressions evaluated and compiled with a new parser each time compared with
+// parsers sharing a calcContext, as the batch and server threads do. Besides
+// the time, the number of mallocs per expression is counted once everything
+// has been seen once. With a context it should be 0.
+
+#include <chrono>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include "calcParser.hpp"
+
+// glibc's own allocator behind the counted one
+extern "C" {
+void *__libc_malloc(size_t);
+void *__libc_calloc(size_t, size_t);
+void *__libc_realloc(void *, size_t);
+}
+
+static ulong mallocs = 0;
+
+extern "C" void *malloc(size_t n) {
+  ++mallocs;
+  return __libc_malloc(n);
+}
+extern "C" void *calloc(size_t n, size_t s) {
+  ++mallocs;
+  return __libc_calloc(n, s);
+}
+extern "C" void *realloc(void *p, size_t n) {
+  ++mallocs;
+  return __libc_realloc(p, n);
+}
+
+static const ulong rounds = 200000;
+
+static volatile double sink;
+
+static std::vector<std::string> expressions() {
+  std::vector<std::string> e = {"1 + 2 * 3 - 4 / (5 + 6)",
+                                "sin(30) + cos(60) * tan(45)",
+                                "2^10 - 5P2 + 6C3 & 7 | 8",
+                                "(1 + 2) * (1 + 2) + log(2)(8)"};
+  // Deep enough to grow the stacks
+  std::string deep;
+  for (int i = 0; i < 100; ++i)
+    deep += "(1 + ";
+  deep += "1";
+  for (int i = 0; i < 100; ++i)
+    deep += ")";
+  e.push_back(deep);
+  return e;
+}
+
+template <typename F>
+static void measure(constStr name, const std::vector<std::string> &e, F f) {
+  // Warm up so that everything has grown once
+  for (const std::string &s : e)
+    f(s);
+  const ulong before = mallocs;
+  auto begin = std::chrono::steady_clock::now();
+  for (ulong i = 0; i < rounds; ++i)
+    f(e[i % e.size()]);
+  auto end = std::chrono::steady_clock::now();
+  printf("%-20s %10.2f %10.3f\n", name,
+         std::chrono::duration<double, std::nano>(end - begin).count() / rounds,
+         (double)(mallocs - before) / rounds);
+}
+
+int main() {
+  const std::vector<std::string> e = expressions();
+  calcContext<double> context;
+  calcProgram<double> program;
+
+  printf("%-20s %10s %10s\n", "case", "ns", "mallocs");
+  measure("parse", e, [](const std::string &s) {
+    calcParse<double> p(s.c_str(), s.size());
+    p.storeAnswers = false;
+    p.tryParsing();
+    sink = p.Ans();
+  });
+  measure("parse, context", e, [&](const std::string &s) {
+    calcParse<double> p(context, s.c_str(), s.size());
+    p.storeAnswers = false;
+    p.tryParsing();
+    sink = p.Ans();
+  });
+  measure("compile", e, [&](const std::string &s) {
+    calcParse<double> p(s.c_str(), s.size());
+    p.tryCompiling(program);
+    sink = program.size();
+  });
+  measure("compile, context", e, [&](const std::string &s) {
+    calcParse<double> p(context, s.c_str(), s.size());
+    p.tryCompiling(program);
+    sink = program.size();
+  });
+  printf("arena: %lu bytes\n", context.arenaSize());
+  return 0;
+}
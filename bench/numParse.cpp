@@ -0,0 +1,102 @@
+// Time taken to read number literals by strToNum() compared with the
+// algorithm it replaced, which added every digit of the fraction as
+// powl(10, -j). The old one also isn't correctly rounded, so the number of
+// literals it reads differently from strtod() is printed too.
+
+#include <chrono>
+#include <random>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "str.hpp"
+
+static const ulong rounds = 20;
+
+static volatile double sink;
+
+// strToNum() before it was templated
+static uint64_t legacyStrToNum(constStr *a, constStr end, double &x,
+                               datatype d) {
+  bool sign = 0;
+  constStr c = *a, s = *a;
+  bool flag = 0;
+  if (c < end && (*c == '+' || *c == '-')) {
+    if (*c == '-') {
+      if (d == REAL || d == INT)
+        sign = 1;
+      else
+        return 0;
+    }
+    ++c;
+  }
+  if (c < end && isdigit(*c)) {
+    while (c < end && isdigit(*c))
+      x = x * 10 + *(c++) - 48;
+    flag = 1;
+  }
+  if (end - c > 1 && *c == '.' && isdigit(c[1])) {
+    if (d != REAL && d != UREAL)
+      return 0;
+    slong j = 0;
+    while (++c < end && *c > 47 && *c < 58)
+      x = x + powl(10, --j) * (*c - 48);
+    flag = 1;
+  }
+  if (not flag)
+    return 0;
+  *a = c;
+  x = sign ? -x : x;
+  return c - s;
+}
+
+template <typename F>
+static double timeIt(const std::vector<std::string> &literals, F f,
+                     ulong &wrong) {
+  wrong = 0;
+  auto begin = std::chrono::steady_clock::now();
+  for (ulong r = 0; r < rounds; ++r)
+    for (const std::string &l : literals) {
+      constStr a = l.c_str();
+      double x = 0;
+      f(&a, a + l.size(), x);
+      sink = x;
+      wrong += r == 0 && x != strtod(l.c_str(), NULL);
+    }
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::nano>(end - begin).count() /
+         (rounds * literals.size());
+}
+
+int main() {
+  std::mt19937_64 random(42);
+  std::vector<std::string> literals;
+  // Integers and fractions of 1 to 17 digits as found in input files
+  for (ulong i = 0; i < 100000; ++i) {
+    std::string l;
+    for (ulong n = 1 + random() % 17; n--;)
+      l += char('0' + random() % 10);
+    if (random() % 4)
+      l.insert(1 + random() % l.size(), ".");
+    if (l.back() == '.')
+      l += '5';
+    literals.push_back(l);
+  }
+
+  ulong wrong;
+  printf("%-10s %10s %10s\n", "parser", "ns/number", "inexact");
+  double t = timeIt(literals, [](constStr *a, constStr end, double &x) {
+    legacyStrToNum(a, end, x, REAL);
+  }, wrong);
+  printf("%-10s %10.2f %10lu\n", "legacy", t, wrong);
+  t = timeIt(literals, [](constStr *a, constStr end, double &x) {
+    strToNum(a, end, x, REAL);
+  }, wrong);
+  printf("%-10s %10.2f %10lu\n", "strToNum", t, wrong);
+  t = timeIt(literals, [](constStr *a, constStr, double &x) {
+    x = strtod(*a, NULL);
+  }, wrong);
+  printf("%-10s %10.2f %10lu\n", "strtod", t, wrong);
+  return 0;
+}
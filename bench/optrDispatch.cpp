@@ -0,0 +1,66 @@
+// Cost of calculating every operator through operate(), which dispatches on
+// Operator::optrCode, compared with calling the handler directly. The
+// difference is the dispatch overhead and should be the same for every
+// operator.
+
+#include <chrono>
+#include <stdio.h>
+
+#include "calcOptr.hpp"
+
+static const ulong rounds = 2000000;
+
+static volatile double sink;
+
+// Operands inside the domain of every operator
+static void operands(const Operator::optrCode c, double &x, double &y) {
+  switch (c) {
+  case Operator::C_P:
+  case Operator::C_C:
+    x = 5, y = 2;
+    break;
+  case Operator::C_and:
+  case Operator::C_or:
+  case Operator::C_not:
+    x = 1, y = 0;
+    break;
+  case Operator::C_asec:
+  case Operator::C_acosec:
+    x = 0, y = 2;
+    break;
+  default:
+    x = 3, y = 0.5;
+  }
+}
+
+template <typename F> static double timeIt(F f) {
+  auto begin = std::chrono::steady_clock::now();
+  for (ulong i = 0; i < rounds; ++i)
+    f();
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::nano>(end - begin).count() / rounds;
+}
+
+int main() {
+  printf("%-8s %12s %12s %12s\n", "optr", "operate(ns)", "direct(ns)",
+         "dispatch(ns)");
+  for (uint8_t i = 0; i < Operator::C_openBracket; ++i) {
+    const Operator::optrCode c = (Operator::optrCode)i;
+    const Operator top(c);
+    const optrHandler<double>::function f = optrHandler<double>::table[c];
+    double x, y, z;
+    operands(c, x, y);
+
+    double viaTable = timeIt([&] {
+      operate(top, (double)sink * 0 + x, y, z);
+      sink = z;
+    });
+    double direct = timeIt([&] {
+      f((double)sink * 0 + x, y, z);
+      sink = z;
+    });
+    printf("%-8s %12.2f %12.2f %12.2f\n", top.toString(), viaTable, direct,
+           viaTable - direct);
+  }
+  return 0;
+}
@@ -0,0 +1,100 @@
+// calcStack compared with the one it replaced, which allocated 16 elements in
+// its constructor and grew by an increasing factor. An expression of depth 4
+// is the common case. Deep pushes show the cost of growing.
+
+#include <chrono>
+#include <stdio.h>
+
+#include "calcParser.hpp"
+
+static const ulong rounds = 2000000;
+
+static volatile double sink;
+
+// The parts of the old calcStack used here
+template <typename Type> class legacyStack {
+  Type *start;
+  Type *current;
+  ulong size;
+  ulong rate;
+
+  void increaseSize() {
+    Type *temp = new Type[(rate + 1) * size];
+    size = size * (++rate);
+    std::copy(this->start, current, temp);
+    current = temp + (current - this->start);
+    delete[] this->start;
+    this->start = temp;
+  }
+
+public:
+  legacyStack() : start(new Type[16]), current(0), size(16), rate(2) {}
+  ~legacyStack() { delete[] start; }
+  void push(const Type y) {
+    if (current) {
+      if ((ulong)(current - start) == size)
+        this->increaseSize();
+      *current = y;
+    } else
+      *(current = start) = y;
+    ++current;
+  }
+  bool pop(Type &y) {
+    if (current) {
+      y = *(--current);
+      current = start == current ? 0 : current;
+      return 1;
+    }
+    return 0;
+  }
+};
+
+template <typename F> static double timeIt(F f, const ulong n = rounds) {
+  auto begin = std::chrono::steady_clock::now();
+  for (ulong i = 0; i < n; ++i)
+    f();
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::nano>(end - begin).count() / n;
+}
+
+template <typename S> static void expression() {
+  S numbers, operators;
+  double x = 0;
+  for (ulong i = 0; i < 4; ++i) {
+    numbers.push(i);
+    operators.push(i);
+  }
+  while (numbers.pop(x))
+    operators.pop(x);
+  sink = x;
+}
+
+template <typename S> static void deep() {
+  S s;
+  double x = 0;
+  for (ulong i = 0; i < 100000; ++i)
+    s.push(i);
+  while (s.pop(x))
+    ;
+  sink = x;
+}
+
+int main() {
+  printf("%-12s %12s %12s\n", "case", "legacy(ns)", "calcStack(ns)");
+  printf("%-12s %12.2f %12.2f\n", "depth 4",
+         timeIt(expression<legacyStack<double>>),
+         timeIt(expression<calcStack<double>>));
+  printf("%-12s %12.0f %12.0f\n", "depth 100000",
+         timeIt(deep<legacyStack<double>>, 200),
+         timeIt(deep<calcStack<double>>, 200));
+
+  // A whole expression, which now allocates nothing in its stacks
+  constStr e = "1 + 2 * 3 - 4 / (5 + 6)";
+  printf("%-12s %12s %12.2f\n", "calcParse", "-", timeIt([e] {
+           calcParse<double> p(e);
+           p.storeAnswers = false;
+           p.tryParsing();
+           sink = p.Ans();
+         }, rounds / 4));
+  return 0;
+}
@@ -0,0 +1,237 @@
+#ifndef ANSWER_ARCHIVE_H
+#define ANSWER_ARCHIVE_H
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <vector>
+
+#include "calcError.hpp"
+
+// Blocks of answers compressed into a file. Every block holds the same number
+// of answers and is read back on its own, so finding an answer reads a single
+// block. The last block read is kept decompressed.
+//
+// 8 byte answers are compressed like Gorilla does: each one is XORed with the
+// one before it and only the bits which differ are written. Answers which are
+// equal or close to the previous one take a bit or a few. Blocks which don't
+// get smaller and other types are written as they are.
+template <typename Type> class answerArchive {
+  struct block {
+    off_t offset;
+    ulong bytes;
+    // Not compressed
+    bool raw;
+  };
+
+  FILE *file;
+  ulong blockSize;
+  std::vector<block> blocks;
+  off_t end;
+  mutable std::vector<Type> cache;
+  mutable slong cached;
+  mutable std::vector<uint64_t> buffer;
+
+  // Returns false if the block is written as it is
+  static bool encode(const Type *, const ulong, std::vector<uint64_t> &);
+  static void decode(const uint64_t *, const ulong, Type *);
+
+public:
+  explicit answerArchive(const ulong);
+  ~answerArchive();
+  // Use the named file or an anonymous temporary file if it is NULL
+  bool open(constStr path = NULL);
+  bool isOpen() const { return this->file; }
+  ulong blockCount() const { return this->blocks.size(); }
+  // Bytes written to the file
+  ulong size() const { return this->end; }
+  // Compress blockSize answers into a new block
+  ERROR append(const Type *);
+  // Answer pos of block b
+  ERROR find(const ulong b, const ulong pos, Type &) const;
+};
+
+// Bits are written from the most significant one of each word
+class bitWriter {
+  std::vector<uint64_t> &out;
+  uint used;
+
+public:
+  explicit bitWriter(std::vector<uint64_t> &o) : out(o), used(64) {}
+  void write(uint64_t bits, uint n) {
+    if (n == 0)
+      return;
+    if (n < 64)
+      bits &= (1ULL << n) - 1;
+    if (this->used == 64) {
+      this->out.push_back(0);
+      this->used = 0;
+    }
+    uint room = 64 - this->used;
+    if (n <= room) {
+      this->out.back() |= bits << (room - n);
+      this->used += n;
+    } else {
+      this->out.back() |= bits >> (n - room);
+      this->out.push_back(bits << (64 - (n - room)));
+      this->used = n - room;
+    }
+  }
+};
+
+class bitReader {
+  const uint64_t *in;
+  uint used;
+
+public:
+  explicit bitReader(const uint64_t *i) : in(i), used(0) {}
+  uint64_t read(uint n) {
+    if (n == 0)
+      return 0;
+    uint room = 64 - this->used;
+    uint64_t bits;
+    if (n <= room) {
+      bits = (*this->in << this->used) >> (64 - n);
+      this->used += n;
+    } else {
+      bits = (*this->in << this->used) >> (64 - n);
+      ++this->in;
+      bits |= *this->in >> (64 - (n - room));
+      this->used = n - room;
+    }
+    if (this->used == 64) {
+      ++this->in;
+      this->used = 0;
+    }
+    return bits;
+  }
+};
+
+template <typename Type>
+answerArchive<Type>::answerArchive(const ulong n)
+    : file(NULL), blockSize(n), end(0), cache(n), cached(-1) {}
+
+template <typename Type> answerArchive<Type>::~answerArchive() {
+  if (this->file)
+    fclose(this->file);
+}
+
+template <typename Type> bool answerArchive<Type>::open(constStr path) {
+  this->file = path ? fopen(path, "w+b") : tmpfile();
+  return this->file;
+}
+
+template <typename Type>
+bool answerArchive<Type>::encode(const Type *x, const ulong n,
+                                 std::vector<uint64_t> &out) {
+  const ulong rawWords = (n * sizeof(Type) + 7) / 8;
+  out.clear();
+  if (sizeof(Type) != sizeof(uint64_t)) {
+    out.resize(rawWords);
+    memcpy(out.data(), x, n * sizeof(Type));
+    return false;
+  }
+
+  bitWriter w(out);
+  uint64_t prev, v;
+  // Leading and trailing zeros of the last XOR written with its window
+  uint lead = 65, trail = 0;
+  memcpy(&prev, x, 8);
+  w.write(prev, 64);
+  for (ulong i = 1; i < n; prev = v, ++i) {
+    memcpy(&v, x + i, 8);
+    const uint64_t d = v ^ prev;
+    if (d == 0) {
+      w.write(0, 1);
+      continue;
+    }
+    uint l = __builtin_clzll(d), t = __builtin_ctzll(d);
+    // The leading zeros are written in 5 bits
+    l = l > 31 ? 31 : l;
+    if (lead <= 64 && l >= lead && t >= trail) {
+      // Fits in the window of the last one
+      w.write(0b10, 2);
+      w.write(d >> trail, 64 - lead - trail);
+    } else {
+      lead = l;
+      trail = t;
+      const uint bits = 64 - lead - trail;
+      w.write(0b11, 2);
+      w.write(lead, 5);
+      // 64 meaningful bits are written as 0
+      w.write(bits & 63, 6);
+      w.write(d >> trail, bits);
+    }
+  }
+  if (out.size() < rawWords)
+    return true;
+  out.resize(rawWords);
+  memcpy(out.data(), x, n * sizeof(Type));
+  return false;
+}
+
+template <typename Type>
+void answerArchive<Type>::decode(const uint64_t *in, const ulong n, Type *x) {
+  bitReader r(in);
+  uint64_t v = r.read(64);
+  uint lead = 0, trail = 0;
+  memcpy(x, &v, 8);
+  for (ulong i = 1; i < n; ++i) {
+    if (r.read(1)) {
+      if (r.read(1)) {
+        lead = r.read(5);
+        uint bits = r.read(6);
+        bits = bits ? bits : 64;
+        trail = 64 - lead - bits;
+      }
+      v ^= r.read(64 - lead - trail) << trail;
+    }
+    memcpy(x + i, &v, 8);
+  }
+}
+
+template <typename Type> ERROR answerArchive<Type>::append(const Type *x) {
+  if (not this->file)
+    CALC_FAIL(ioError);
+  const bool raw = not encode(x, this->blockSize, this->buffer);
+  const ulong bytes = this->buffer.size() * sizeof(uint64_t);
+  if (pwrite(fileno(this->file), this->buffer.data(), bytes, this->end) !=
+      (ssize_t)bytes)
+    CALC_FAIL(ioError);
+  this->blocks.push_back({this->end, bytes, raw});
+  this->end += bytes;
+  return ERROR();
+}
+
+template <typename Type>
+ERROR answerArchive<Type>::find(const ulong b, const ulong pos,
+                                Type &x) const {
+  if (b >= this->blocks.size() || pos >= this->blockSize)
+    CALC_FAIL(invalidAns);
+  if (this->cached != (slong)b) {
+    const block &k = this->blocks[b];
+    this->buffer.resize(k.bytes / sizeof(uint64_t));
+    if (pread(fileno(this->file), this->buffer.data(), k.bytes, k.offset) !=
+        (ssize_t)k.bytes)
+      CALC_FAIL(ioError);
+    if (k.raw)
+      memcpy(this->cache.data(), this->buffer.data(),
+             this->blockSize * sizeof(Type));
+    else
+      decode(this->buffer.data(), this->blockSize, this->cache.data());
+    this->cached = b;
+  }
+  x = this->cache[pos];
+  return ERROR();
+}
+
+#endif
+
+/*
+  Local Variables:
+  mode: c++
+  c-file-offset: 2
+  fill-column: 80
+  End:
+*/
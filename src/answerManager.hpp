@@ -1,48 +1,70 @@
 #ifndef answerMANAGER
 #define answerMANAGER
 
+#include <algorithm>
+#include <deque>
 #include <limits.h>
+#include <string.h>
+#include <string>
 
+#include "answerArchive.hpp"
+#include "answerStore.hpp"
 #include "calcError.hpp"
 #include "calcStack.hpp"
 
+// History of answers. a1 is the first answer, a2 the second and so on while
+// a0 is the latest one. Answers are kept in chunks of a power of 2 answers
+// which are allocated only when the first answer goes in, so finding one is a
+// shift and a mask. With autoDelete set only the last maxLimit answers(rounded
+// up to whole chunks) are kept and the chunk of the oldest ones is reused for
+// the new ones. Answers keep their numbers when older ones are deleted.
+//
+// After spill() only the latest chunks are kept in memory. Older ones are
+// compressed into an answerArchive instead of being deleted, unless autoDelete
+// is set. Deleting a chunk deletes the older ones in the archive too, and
+// spilling starts over with the chunks after it.
+//
+// After attach() the answers are the ones of an answerStore file shared with
+// other processes. a1 is the first answer ever written to the file and new
+// answers are appended to it by flush().
 template <typename Type> class answerManager {
-  // The Stack Array dynamically allocated at
-  // runtime
-  calcStack<Type> *answerStack;
-  // The number of stacks
-  uint numOfStacks;
-  // Size of each stack
-  uint ansPerStack;
-  // Total number of answers currently being
-  // available
+  std::deque<Type *> chunks;
+  // log2 of answers per chunk
+  uint chunkBits;
+  // Number of chunks deleted or archived from the front of chunks
+  ulong dropped;
+  // Total number of answers ever pushed
   ulong numOfAns;
   // Automatically delete older answers
   bool autoDelete;
-  // Method for increasing the size of the array
-  // answerStack
-  void increaseSize();
-  // Shifting the answer list to delete previous
-  // answers
-  void shift();
+  // Number of answers kept when autoDelete is set
+  ulong maxLimit;
+  // Chunks moved to the archive, which are the ones from archiveFirst to the
+  // first one in memory
+  answerArchive<Type> *archive;
+  ulong archiveFirst;
+  ulong archived;
+  // Chunks kept in memory after spill(). 0 if nothing is spilled.
+  ulong hotChunks;
+  std::string spillPath;
+  answerStore<Type> *shared;
+
+  void setChunkSize(ulong);
 
 public:
   // Destructor for the answerManager
   ~answerManager();
-  // Construct a default object having
-  // numOfStacks = 1024,
-  // ansPerStack = 8192,
-  // numOfAns = 0,
-  // autoDelete = false
+  // Construct an empty history. Nothing is allocated until the first push.
   answerManager();
-  // Construct an object specifying the number of
-  // stacks to start with
+  // The number of stacks is only kept for compatibility. Nothing is
+  // allocated in advance.
   explicit answerManager(const uint);
   // Construct an object which is a copy of
-  // another one
+  // another one. Spilled answers are only copied if a file for them can be
+  // written, older ones are invalidAns otherwise.
   answerManager(const answerManager &);
   // Construct an object specifying number of stacks
-  // and answers per stack
+  // and answers per stack. Answers per stack is rounded up to a power of 2.
   answerManager(const uint, const uint);
   // Construct an object specifying to auto delete
   // answers and the max limit of answers to be
@@ -51,119 +73,211 @@ public:
   // Construct an object specifying to auto delete,
   // number of stacks and answers per stack
   answerManager(const bool, const uint, const uint);
+  // Answers allocated, spilled or deleted together
+  ulong chunkSize() const { return 1UL << this->chunkBits; }
   // Return the number of answers in the list
-  ulong answerCount() const { return this->numOfAns; }
+  ulong answerCount() const {
+    return this->shared ? this->shared->answerCount() : this->numOfAns;
+  }
+  // Number of the oldest answer still kept
+  ulong oldestAns() const {
+    return ((this->archived ? this->archiveFirst : this->dropped)
+            << this->chunkBits) + 1;
+  }
   // Check if there are any answers
-  bool isEmpty() const { return !this->numOfAns; }
+  bool isEmpty() const { return !this->answerCount(); }
   void toggleAutoDelete();
+  // Keep only the last n answers(rounded up to whole chunks)
+  void setLimit(const ulong n);
+  // Keep only the last hot chunks in memory and compress older ones into the
+  // named file or a temporary file. The file is created when the first chunk
+  // is spilled.
+  void spill(const ulong hot = 16, constStr path = NULL);
+  // Bytes taken by the spilled answers
+  ulong spilledSize() const {
+    return this->archive ? this->archive->size() : 0;
+  }
+  // Use the answers of a file shared with other processes instead
+  ERROR attach(constStr path);
+  // Write the answers pushed since the last flush to the attached file
+  ERROR flush();
   void parseAns(constStr &, Type &) const;
+  void parseAns(constStr &, constStr, Type &) const;
+  // These return the error instead of throwing it
+  static ERROR parseAnsPos(constStr &, constStr, ulong &);
+  ERROR findAns(Type &, ulong pos = 0) const;
   void getAns(Type &, ulong pos = 0) const;
   void display() const;
+  // Returns the error instead of throwing it
+  ERROR tryPush(const Type);
   void push(const Type);
 };
 
-answerManager<float64_t> answers;
-
 extern answerManager<long double> ansList;
 extern bool store;
 
-template <typename Type> void answerManager<Type>::increaseSize() {
-  if (++numOfStacks == 0) {
-    --numOfStacks;
-    error(outOfRange);
-  }
-  try {
-    calcStack<Type> *tmp = new calcStack<Type>[numOfStacks];
-    uint i;
-    for (i = 0; i < numOfStacks - 1; ++i)
-      tmp[i] = this->answerStack[i];
-    tmp[i].setCapacity(this->ansPerStack);
-    delete[] this->answerStack;
-    this->answerStack = tmp;
-  } catch (const std::bad_alloc &x) {
-    error(memAlloc);
-  }
-}
-
-template <typename Type> void answerManager<Type>::shift() {
-  try {
-    calcStack<Type> *tmp = new calcStack<Type>[numOfStacks];
-    for (uint i = 1; i < numOfStacks; ++i)
-      tmp[i - 1] = answerStack[i];
-    delete[] answerStack;
-    answerStack = tmp;
-    numOfAns -= ansPerStack;
-  } catch (const std::bad_alloc &x) {
-    error(memAlloc);
-  }
+template <typename Type> void answerManager<Type>::setChunkSize(ulong n) {
+  this->chunkBits = 0;
+  while ((1UL << this->chunkBits) < n && this->chunkBits < 30)
+    ++this->chunkBits;
 }
 
 template <typename Type> answerManager<Type>::~answerManager() {
-  delete[] answerStack;
+  for (Type *c : this->chunks)
+    delete[] c;
+  delete this->archive;
+  if (this->shared)
+    this->flush();
+  delete this->shared;
 }
 
-template <typename Type> answerManager<Type>::answerManager() {
-  numOfStacks = 1024;
-  answerStack = new calcStack<Type>[numOfStacks];
-  ansPerStack = 8192;
-  for (uint i = 0; i < numOfStacks; ++i)
-    answerStack[i].setCapacity(ansPerStack);
-  numOfAns = 0;
-  autoDelete = false;
-}
+template <typename Type>
+answerManager<Type>::answerManager()
+    : chunkBits(12), dropped(0), numOfAns(0), autoDelete(false), maxLimit(0),
+      archive(NULL), archiveFirst(0), archived(0), hotChunks(0), spillPath(),
+      shared(NULL) {}
+
+template <typename Type>
+answerManager<Type>::answerManager(const uint) : answerManager() {}
 
-template <typename Type> answerManager<Type>::answerManager(const uint nos) {
-  numOfStacks = nos;
-  answerStack = new calcStack<Type>[numOfStacks];
-  ansPerStack = 10000;
-  for (uint i = 0; i < numOfStacks; ++i)
-    answerStack[i].setCapacity(ansPerStack);
-  numOfAns = 0;
-  autoDelete = false;
+template <typename Type>
+answerManager<Type>::answerManager(const answerManager &a)
+    : chunkBits(a.chunkBits), dropped(a.dropped), numOfAns(a.numOfAns),
+      autoDelete(a.autoDelete), maxLimit(a.maxLimit), archive(NULL),
+      archiveFirst(a.archiveFirst), archived(0), hotChunks(a.hotChunks),
+      shared(NULL) {
+  for (const Type *c : a.chunks) {
+    this->chunks.push_back(new Type[this->chunkSize()]);
+    std::copy(c, c + this->chunkSize(), this->chunks.back());
+  }
+  // The copy gets a temporary file of its own. If it can't be written, the
+  // copy goes without the spilled answers, as if autoDelete dropped them.
+  if (a.archived) {
+    std::vector<Type> block(this->chunkSize());
+    this->archive = new answerArchive<Type>(this->chunkSize());
+    bool copied = this->archive->open();
+    for (ulong b = 0; copied && b < a.archived; ++b) {
+      for (ulong i = 0; copied && i < this->chunkSize(); ++i)
+        copied = not a.archive->find(b, i, block[i]).isSet();
+      copied = copied && not this->archive->append(block.data()).isSet();
+    }
+    if (copied) {
+      this->archived = a.archived;
+    } else {
+      delete this->archive;
+      this->archive = NULL;
+    }
+  }
 }
 
 template <typename Type>
-answerManager<Type>::answerManager(const uint nos, const uint aps) {
-  numOfStacks = nos;
-  answerStack = new calcStack<Type>[numOfStacks];
-  ansPerStack = aps;
-  for (uint i = 0; i < numOfStacks; ++i)
-    answerStack[i].setCapacity(ansPerStack);
-  numOfAns = 0;
-  autoDelete = false;
+answerManager<Type>::answerManager(const uint, const uint aps)
+    : answerManager() {
+  this->setChunkSize(aps);
 }
 
 template <typename Type>
-answerManager<Type>::answerManager(const bool ad, const ulong maxLt) {
-  autoDelete = ad;
-  numOfStacks = maxLt / 10000 + (autoDelete ? 2 : 1);
-  ansPerStack = 10000;
-  numOfAns = 0;
-  answerStack = new calcStack<Type>[numOfStacks];
-  for (uint i = 0; i < numOfStacks; ++i)
-    answerStack[i].setCapacity(ansPerStack);
+answerManager<Type>::answerManager(const bool ad, const ulong maxLt)
+    : answerManager() {
+  this->autoDelete = ad;
+  this->maxLimit = maxLt;
 }
 
 template <typename Type>
 answerManager<Type>::answerManager(const bool ad, const uint nos,
-                                   const uint aps) {
+                                   const uint aps)
+    : answerManager() {
+  this->setChunkSize(aps);
   this->autoDelete = ad;
-  this->numOfStacks = nos + (ad ? 1 : 0);
-  this->answerStack = new calcStack<Type>[this->numOfStacks];
-  this->ansPerStack = aps;
-  for (uint i = 0; i < numOfStacks; ++i)
-    this->answerStack[i].setCapacity(aps);
-  this->numOfAns = 0;
+  this->maxLimit = (ulong)nos * aps;
 }
 
-template <typename Type> void answerManager<Type>::push(const Type x) {
-  this->answerStack[this->numOfAns++ / this->numOfStacks].push(x);
-  if (this->numOfAns == this->numOfStacks * this->ansPerStack) {
-    if (autoDelete)
-      this->shift();
-    else
-      this->increaseSize();
+template <typename Type> void answerManager<Type>::setLimit(const ulong n) {
+  this->maxLimit = n;
+  this->autoDelete = true;
+}
+
+template <typename Type>
+void answerManager<Type>::spill(const ulong hot, constStr path) {
+  this->hotChunks = hot ? hot : 1;
+  this->spillPath = path ? path : "";
+}
+
+template <typename Type> ERROR answerManager<Type>::attach(constStr path) {
+  answerStore<Type> *s = new answerStore<Type>;
+  const ERROR e = s->open(path);
+  if (e.isSet()) {
+    delete s;
+    return e;
   }
+  if (this->shared)
+    CALC_TRY(this->flush());
+  delete this->shared;
+  this->shared = s;
+  return ERROR();
+}
+
+template <typename Type> ERROR answerManager<Type>::flush() {
+  return this->shared ? this->shared->commit() : ERROR();
+}
+
+template <typename Type> ERROR answerManager<Type>::tryPush(const Type x) {
+  if (this->shared) {
+    this->shared->push(x);
+    // Bound what is lost if the process dies
+    if (this->shared->pendingCount() >= this->chunkSize())
+      return this->flush();
+    return ERROR();
+  }
+  const ulong i = this->numOfAns;
+  if ((i & (this->chunkSize() - 1)) == 0) {
+    // Number of chunks holding at least maxLimit answers besides the new one
+    const ulong keep =
+        (this->maxLimit + this->chunkSize() - 1) >> this->chunkBits;
+    if (this->autoDelete && not this->chunks.empty() &&
+        this->chunks.size() > keep) {
+      // Reuse the oldest chunk. Archived ones are older still.
+      this->chunks.push_back(this->chunks.front());
+      this->chunks.pop_front();
+      ++this->dropped;
+      delete this->archive;
+      this->archive = NULL;
+      this->archived = 0;
+    } else if (not this->autoDelete && this->hotChunks &&
+               this->chunks.size() >= this->hotChunks) {
+      // Compress the oldest chunk and reuse it
+      if (not this->archive) {
+        this->archiveFirst = this->dropped;
+        this->archive = new answerArchive<Type>(this->chunkSize());
+        if (not this->archive->open(
+                this->spillPath.empty() ? NULL : this->spillPath.c_str())) {
+          delete this->archive;
+          this->archive = NULL;
+          CALC_FAIL(ioError);
+        }
+      }
+      CALC_TRY(this->archive->append(this->chunks.front()));
+      this->chunks.push_back(this->chunks.front());
+      this->chunks.pop_front();
+      ++this->dropped;
+      ++this->archived;
+    } else {
+      try {
+        this->chunks.push_back(new Type[this->chunkSize()]);
+      } catch (const std::bad_alloc &x) {
+        CALC_FAIL(memAlloc);
+      }
+    }
+  }
+  this->chunks.back()[i & (this->chunkSize() - 1)] = x;
+  ++this->numOfAns;
+  return ERROR();
+}
+
+template <typename Type> void answerManager<Type>::push(const Type x) {
+  const ERROR e = this->tryPush(x);
+  if (e.isSet())
+    throw new ERROR(e);
 }
 
 template <typename Type> void answerManager<Type>::toggleAutoDelete() {
@@ -172,35 +286,86 @@ template <typename Type> void answerManager<Type>::toggleAutoDelete() {
 
 template <typename Type>
 void answerManager<Type>::parseAns(constStr &s, Type &x) const {
-  if (*s != 'a')
-    error(parseError);
+  this->parseAns(s, s + strlen(s), x);
+}
+
+template <typename Type>
+void answerManager<Type>::parseAns(constStr &s, constStr end,
+                                   Type &x) const {
+  ulong y;
+  ERROR e = this->parseAnsPos(s, end, y);
+  if (not e.isSet())
+    e = this->findAns(x, y);
+  if (e.isSet())
+    throw new ERROR(e);
+}
+
+// Read the answer number from an answer reference like "a12" ending before
+// end. The number is not checked against the available answers.
+template <typename Type>
+ERROR answerManager<Type>::parseAnsPos(constStr &s, constStr end,
+                                       ulong &y) {
+  if (s >= end || *s != 'a')
+    CALC_FAIL(parseError);
   constStr c = s + 1;
-  ulong y = 0;
-  while (*c > 47 && *c < 58) {
+  y = 0;
+  while (c < end && *c > 47 && *c < 58) {
     if (y > (ULONG_MAX - *c + 48) / 10)
-      error(invalidAns);
+      CALC_FAIL(invalidAns);
     y = y * 10 + *(c++) - 48;
   }
-  if (y > numOfAns)
-    error(invalidAns);
   // If 'c' hasn't changed since its initial value then it is a parseError
-  if (c != s + 1) {
-    s = c;
-    this->getAns(x, y);
+  if (c == s + 1)
+    CALC_FAIL(parseError);
+  s = c;
+  return ERROR();
+}
+
+template <typename Type>
+ERROR answerManager<Type>::findAns(Type &x, ulong pos) const {
+  if (this->shared) {
+    if (pos == 0 && this->shared->pendingCount() == 0)
+      CALC_TRY(this->shared->refresh());
+    pos = pos ? pos : this->shared->answerCount();
+    if (pos == 0)
+      CALC_FAIL(invalidAns);
+    return this->shared->find(pos - 1, x);
   }
+  // a0 is the latest answer
+  if (pos == 0)
+    pos = this->numOfAns;
+  if (pos == 0 || pos > this->numOfAns || pos < this->oldestAns())
+    CALC_FAIL(invalidAns);
+  const ulong i = pos - 1, c = i >> this->chunkBits;
+  // Archived chunks are the last ones dropped
+  if (c < this->dropped && c + this->archived >= this->dropped)
+    return this->archive->find(c - this->archiveFirst,
+                               i & (this->chunkSize() - 1), x);
+  // Deleted after autoDelete was turned on
+  if (c < this->dropped)
+    CALC_FAIL(invalidAns);
+  x = this->chunks[c - this->dropped][i & (this->chunkSize() - 1)];
+  return ERROR();
 }
 
 template <typename Type>
 void answerManager<Type>::getAns(Type &x, ulong pos) const {
-  uint stackNo = pos / this->ansPerStack;
-  uint posInStack = pos % this->ansPerStack;
-  if (not this->answerStack[stackNo].find(posInStack, x))
-    error(invalidAns);
+  const ERROR e = this->findAns(x, pos);
+  if (e.isSet())
+    throw new ERROR(e);
 }
 
 template <typename Type> void answerManager<Type>::display() const {
-  for (uint i = 0; i < this->numOfAns; i += this->ansPerStack)
-    this->answerStack[i].display();
+  Type x;
+  if (this->shared) {
+    for (ulong i = 0; i < this->shared->answerCount(); ++i)
+      if (not this->shared->find(i, x).isSet())
+        std::cout << 'a' << i + 1 << " = " << x << '\n';
+    return;
+  }
+  for (ulong i = this->oldestAns(); i <= this->numOfAns; ++i)
+    if (not this->findAns(x, i).isSet())
+      std::cout << 'a' << i << " = " << x << '\n';
 }
 
 #endif
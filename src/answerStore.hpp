@@ -0,0 +1,226 @@
+#ifndef ANSWER_STORE_H
+#define ANSWER_STORE_H
+
+#include <cstddef>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#include "calcError.hpp"
+
+// Answers kept in a file which many processes share. The file is mapped into
+// memory and answers are read right from the mapping.
+//
+// The file starts with a header page holding two slots. Each slot has the
+// number of committed answers, a sequence number and a checksum. A commit
+// appends the answers after the last committed one, syncs them and then
+// writes the slot not holding the latest sequence number. A crash in between
+// leaves the other slot valid, so readers never see answers which weren't
+// completely written. Writers hold an exclusive flock() while committing.
+template <typename Type> class answerStore {
+  struct slot {
+    uint64_t seq;
+    uint64_t count;
+    uint64_t check;
+  };
+  struct fileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t typeSize;
+    slot slots[2];
+  };
+
+  static const off_t dataStart = 4096;
+
+  int fd;
+  // The mapped file and its answers
+  const char *base;
+  const Type *map;
+  // Answers covered by map
+  ulong mapped;
+  // Latest valid slot read
+  slot latest;
+  // Pushed but not committed
+  std::vector<Type> pending;
+
+  static uint64_t checksum(const slot &);
+  ERROR readSlot(slot &) const;
+  ERROR remap(const ulong);
+
+public:
+  answerStore();
+  ~answerStore();
+  // Open or create the file
+  ERROR open(constStr);
+  bool isOpen() const { return this->fd >= 0; }
+  // Committed answers seen so far and the ones pending
+  ulong answerCount() const {
+    return this->latest.count + this->pending.size();
+  }
+  ulong pendingCount() const { return this->pending.size(); }
+  // Look for answers committed by others since the last look
+  ERROR refresh();
+  // Answer i counting from 0
+  ERROR find(const ulong, Type &);
+  void push(const Type x) { this->pending.push_back(x); }
+  // Append the pending answers to the file
+  ERROR commit();
+};
+
+template <typename Type>
+answerStore<Type>::answerStore()
+    : fd(-1), base(NULL), map(NULL), mapped(0), latest() {}
+
+template <typename Type> answerStore<Type>::~answerStore() {
+  if (this->base)
+    munmap((void *)this->base, dataStart + this->mapped * sizeof(Type));
+  if (this->fd >= 0)
+    close(this->fd);
+}
+
+template <typename Type> uint64_t answerStore<Type>::checksum(const slot &s) {
+  // FNV-1a over the two fields
+  uint64_t h = 14695981039346656037ULL;
+  const uint64_t v[2] = {s.seq, s.count};
+  const uchar *b = (const uchar *)v;
+  for (ulong i = 0; i < sizeof(v); ++i)
+    h = (h ^ b[i]) * 1099511628211ULL;
+  return h;
+}
+
+template <typename Type> ERROR answerStore<Type>::readSlot(slot &s) const {
+  fileHeader h;
+  if (pread(this->fd, &h, sizeof(h), 0) != sizeof(h))
+    CALC_FAIL(ioError);
+  const bool a = checksum(h.slots[0]) == h.slots[0].check,
+             b = checksum(h.slots[1]) == h.slots[1].check;
+  if (not a && not b)
+    CALC_FAIL(ioError);
+  s = a && (not b || h.slots[0].seq > h.slots[1].seq) ? h.slots[0]
+                                                       : h.slots[1];
+  return ERROR();
+}
+
+template <typename Type> ERROR answerStore<Type>::open(constStr path) {
+  this->fd = ::open(path, O_RDWR | O_CREAT, 0644);
+  if (this->fd < 0)
+    CALC_FAIL(ioError);
+
+  flock(this->fd, LOCK_EX);
+  struct stat st;
+  fileHeader h;
+  ERROR e;
+  if (fstat(this->fd, &st) != 0) {
+    e = ERROR::ioError;
+  } else if (st.st_size == 0) {
+    // A new file
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, "advCalcA", 8);
+    h.version = 1;
+    h.typeSize = sizeof(Type);
+    h.slots[0].check = checksum(h.slots[0]);
+    h.slots[1].check = checksum(h.slots[1]);
+    if (pwrite(this->fd, &h, sizeof(h), 0) != sizeof(h) ||
+        ftruncate(this->fd, dataStart) != 0 || fdatasync(this->fd) != 0)
+      e = ERROR::ioError;
+  } else if (pread(this->fd, &h, sizeof(h), 0) != sizeof(h) ||
+             memcmp(h.magic, "advCalcA", 8) || h.version != 1 ||
+             h.typeSize != sizeof(Type)) {
+    e = ERROR::ioError;
+  }
+  flock(this->fd, LOCK_UN);
+
+  if (not e.isSet())
+    e = this->refresh();
+  if (e.isSet()) {
+    close(this->fd);
+    this->fd = -1;
+  }
+  return e;
+}
+
+template <typename Type> ERROR answerStore<Type>::remap(const ulong count) {
+  if (count <= this->mapped)
+    return ERROR();
+  if (this->base)
+    munmap((void *)this->base, dataStart + this->mapped * sizeof(Type));
+  void *m = mmap(NULL, dataStart + count * sizeof(Type), PROT_READ,
+                 MAP_SHARED, this->fd, 0);
+  if (m == MAP_FAILED) {
+    this->base = NULL;
+    this->map = NULL;
+    this->mapped = 0;
+    CALC_FAIL(ioError);
+  }
+  this->base = (const char *)m;
+  this->map = (const Type *)(this->base + dataStart);
+  this->mapped = count;
+  return ERROR();
+}
+
+template <typename Type> ERROR answerStore<Type>::refresh() {
+  slot s;
+  CALC_TRY(this->readSlot(s));
+  CALC_TRY(this->remap(s.count));
+  this->latest = s;
+  return ERROR();
+}
+
+template <typename Type>
+ERROR answerStore<Type>::find(const ulong i, Type &x) {
+  const ulong committed = this->latest.count;
+  if (i >= committed && i < committed + this->pending.size()) {
+    x = this->pending[i - committed];
+    return ERROR();
+  }
+  // Others might have committed it
+  if (i >= committed && this->pending.empty())
+    CALC_TRY(this->refresh());
+  if (i >= this->latest.count)
+    CALC_FAIL(invalidAns);
+  x = this->map[i];
+  return ERROR();
+}
+
+template <typename Type> ERROR answerStore<Type>::commit() {
+  if (this->pending.empty())
+    return ERROR();
+  flock(this->fd, LOCK_EX);
+  slot s;
+  ERROR e = this->readSlot(s);
+  const ulong bytes = this->pending.size() * sizeof(Type);
+  if (not e.isSet() &&
+      (pwrite(this->fd, this->pending.data(), bytes,
+              dataStart + s.count * sizeof(Type)) != (ssize_t)bytes ||
+       fdatasync(this->fd) != 0))
+    e = ERROR::ioError;
+  if (not e.isSet()) {
+    // Replace the older slot
+    slot n = {s.seq + 1, s.count + this->pending.size(), 0};
+    n.check = checksum(n);
+    if (pwrite(this->fd, &n, sizeof(n),
+               offsetof(fileHeader, slots) + (n.seq & 1) * sizeof(slot)) !=
+            sizeof(n) ||
+        fdatasync(this->fd) != 0)
+      e = ERROR::ioError;
+  }
+  flock(this->fd, LOCK_UN);
+  if (e.isSet())
+    return e;
+  this->pending.clear();
+  return this->refresh();
+}
+
+#endif
+
+/*
+  Local Variables:
+  mode: c++
+  c-file-offset: 2
+  fill-column: 80
+  End:
+*/
@@ -0,0 +1,270 @@
+#ifndef CALC_AST_H
+#define CALC_AST_H
+
+#include <cmath>
+#include <functional>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "calcArena.hpp"
+#include "calcProgram.hpp"
+
+// Expression graph built from a compiled program. Nodes are hash-consed, so
+// equal subexpressions share a single node. While building, subtrees having
+// only numbers are folded into a number and the identities x*1, 1*x, x+0, 0+x,
+// x-0, x/1 and x^1 are reduced to x. emit() writes the graph back as a program
+// which calculates every shared subexpression once.
+//
+// Trigonometric functions are folded using the angle unit of the program.
+//
+// Given an arena every container takes its memory from it, so the graph has
+// to be gone before the arena is reset.
+//
+// A program which doesn't leave exactly one number makes an empty graph.
+template <typename numT> class calcAST {
+  static const ulong none = ~0UL;
+  template <typename T> using list = std::vector<T, arenaAllocator<T>>;
+
+  struct node {
+    // calcProgram<numT>::instrType or Operator::optrCode
+    uint8_t type;
+    // Answer number or variable index of leaves
+    ulong arg;
+    // Operands. Unary operators only have the right one.
+    ulong left, right;
+    numT value;
+    // Number of parents using this node
+    ulong uses;
+    // Temporary holding the value once it is calculated
+    slong temp;
+  };
+
+  calcArena *arena;
+  uint8_t angle;
+  list<node> nodes;
+  std::unordered_multimap<size_t, ulong, std::hash<size_t>,
+                          std::equal_to<size_t>,
+                          arenaAllocator<std::pair<const size_t, ulong>>>
+      table;
+  ulong root;
+
+  bool isNum(const ulong n) const {
+    return n != none && nodes[n].type == calcProgram<numT>::I_num;
+  }
+  bool isNum(const ulong n, const numT x) const {
+    return this->isNum(n) && nodes[n].value == x;
+  }
+  bool sameNode(const node &, const node &) const;
+  ulong intern(const node &);
+  ulong number(const numT);
+  ulong leaf(const uint8_t, const ulong);
+  ulong combine(const Operator::optrCode, const ulong, const ulong);
+
+public:
+  explicit calcAST(const calcProgram<numT> &, calcArena *arena = NULL);
+  bool isEmpty() const { return this->root == none; }
+  // Number of distinct nodes reachable from the root
+  ulong size() const;
+  void emit(calcProgram<numT> &);
+};
+
+template <typename numT> const ulong calcAST<numT>::none;
+
+template <typename numT>
+bool calcAST<numT>::sameNode(const node &a, const node &b) const {
+  if (a.type != b.type || a.arg != b.arg || a.left != b.left ||
+      a.right != b.right)
+    return false;
+  if (a.type != calcProgram<numT>::I_num)
+    return true;
+  // 0 and -0 are different numbers here
+  return a.value == b.value && std::signbit(a.value) == std::signbit(b.value);
+}
+
+template <typename numT> ulong calcAST<numT>::intern(const node &n) {
+  size_t h = n.type;
+  h = h * 31 + std::hash<ulong>()(n.arg);
+  h = h * 31 + std::hash<ulong>()(n.left);
+  h = h * 31 + std::hash<ulong>()(n.right);
+  if (n.type == calcProgram<numT>::I_num)
+    h = h * 31 + std::hash<numT>()(n.value);
+
+  auto range = this->table.equal_range(h);
+  for (auto i = range.first; i != range.second; ++i)
+    if (this->sameNode(this->nodes[i->second], n))
+      return i->second;
+
+  this->nodes.push_back(n);
+  this->table.insert(std::make_pair(h, this->nodes.size() - 1));
+  return this->nodes.size() - 1;
+}
+
+template <typename numT> ulong calcAST<numT>::number(const numT x) {
+  return this->intern({calcProgram<numT>::I_num, 0, none, none, x, 0, -1});
+}
+
+template <typename numT>
+ulong calcAST<numT>::leaf(const uint8_t type, const ulong arg) {
+  return this->intern({type, arg, none, none, 0, 0, -1});
+}
+
+template <typename numT>
+ulong calcAST<numT>::combine(const Operator::optrCode code, const ulong x,
+                             const ulong y) {
+  Operator top(code);
+
+  if (this->isNum(y) && (top.isUnary() || this->isNum(x))) {
+    numT z;
+    // On an error the operator is kept for run() to report it
+    if (not operate(top, top.isUnary() ? numT(0) : nodes[x].value,
+                    nodes[y].value, z, this->angle).isSet())
+      return this->number(z);
+  }
+
+  switch (code) {
+  case Operator::C_multiply:
+    if (this->isNum(x, 1))
+      return y;
+    if (this->isNum(y, 1))
+      return x;
+    break;
+  case Operator::C_plus:
+    if (this->isNum(x, 0))
+      return y;
+    if (this->isNum(y, 0))
+      return x;
+    break;
+  case Operator::C_minus:
+    if (this->isNum(y, 0))
+      return x;
+    break;
+  case Operator::C_divide:
+  case Operator::C_pow:
+    if (this->isNum(y, 1))
+      return x;
+    break;
+  default:
+    break;
+  }
+
+  return this->intern({(uint8_t)code, 0, x, y, 0, 0, -1});
+}
+
+template <typename numT>
+calcAST<numT>::calcAST(const calcProgram<numT> &program, calcArena *arena)
+    : arena(arena), angle(program.angle), nodes(arena),
+      table(0, std::hash<size_t>(), std::equal_to<size_t>(), arena),
+      root(none) {
+  typedef calcProgram<numT> prog;
+  list<ulong> stack(arena), temps(program.temps.size(), none, arena);
+  ulong x, y;
+
+  this->nodes.reserve(program.code.size());
+
+  for (const typename prog::instr &i : program.code) {
+    switch (i.type) {
+    case prog::I_num:
+      stack.push_back(this->number(program.numbers[i.arg]));
+      break;
+    case prog::I_ans:
+    case prog::I_var:
+      stack.push_back(this->leaf(i.type, i.arg));
+      break;
+    case prog::I_store:
+      temps[i.arg] = stack.back();
+      break;
+    case prog::I_load:
+      stack.push_back(temps[i.arg]);
+      break;
+    default:
+      const bool unary = Operator((Operator::optrCode)i.type).isUnary();
+      if (stack.size() < (unary ? 1U : 2U))
+        return;
+      y = stack.back();
+      stack.pop_back();
+      x = none;
+      if (not unary) {
+        x = stack.back();
+        stack.pop_back();
+      }
+      stack.push_back(this->combine((Operator::optrCode)i.type, x, y));
+    }
+  }
+
+  if (stack.size() != 1)
+    return;
+  this->root = stack.back();
+
+  // Parents always come after their operands, so a single backward pass
+  // counts the uses of every reachable node
+  this->nodes[this->root].uses = 1;
+  for (ulong n = this->root + 1; n-- > 0;) {
+    if (not this->nodes[n].uses)
+      continue;
+    if (this->nodes[n].left != none)
+      ++this->nodes[this->nodes[n].left].uses;
+    if (this->nodes[n].right != none)
+      ++this->nodes[this->nodes[n].right].uses;
+  }
+}
+
+template <typename numT> ulong calcAST<numT>::size() const {
+  if (this->isEmpty())
+    return 0;
+  ulong count = 0;
+  for (const node &n : this->nodes)
+    count += n.uses ? 1 : 0;
+  return count;
+}
+
+template <typename numT> void calcAST<numT>::emit(calcProgram<numT> &program) {
+  typedef calcProgram<numT> prog;
+  // Node and whether its operands are already emitted
+  list<std::pair<ulong, bool>> work(this->arena);
+  ulong temps = 0;
+
+  program.code.clear();
+  program.numbers.clear();
+  work.push_back(std::make_pair(this->root, false));
+
+  while (not work.empty()) {
+    ulong n = work.back().first;
+    bool expanded = work.back().second;
+    node &d = this->nodes[n];
+    work.pop_back();
+
+    if (d.temp >= 0) {
+      program.code.push_back({prog::I_load, (ulong)d.temp});
+    } else if (d.type == prog::I_num) {
+      program.code.push_back({prog::I_num, program.numbers.size()});
+      program.numbers.push_back(d.value);
+    } else if (d.type == prog::I_ans || d.type == prog::I_var) {
+      program.code.push_back({d.type, d.arg});
+    } else if (not expanded) {
+      work.push_back(std::make_pair(n, true));
+      work.push_back(std::make_pair(d.right, false));
+      if (d.left != none)
+        work.push_back(std::make_pair(d.left, false));
+    } else {
+      program.code.push_back({d.type, 0});
+      if (d.uses > 1) {
+        d.temp = temps++;
+        program.code.push_back({prog::I_store, (ulong)d.temp});
+      }
+    }
+  }
+
+  program.temps.assign(temps, 0);
+  program.depth = 1;
+}
+
+#endif
+
+/*
+  Local Variables:
+  mode: c++
+  c-file-offset: 2
+  fill-column: 80
+  End:
+*/
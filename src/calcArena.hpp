@@ -0,0 +1,114 @@
+#ifndef CALC_ARENA_H
+#define CALC_ARENA_H
+
+#include <new>
+#include <stdlib.h>
+#include <vector>
+
+#include "common.hpp"
+
+// Memory handed out by bumping a pointer through large blocks. Nothing is
+// freed on its own; reset() makes all of it available again while keeping
+// the blocks, so an arena reset between expressions stops allocating once it
+// has seen the largest one.
+class calcArena {
+  static const ulong blockSize = 64 * 1024;
+
+  std::vector<char *> blocks;
+  std::vector<ulong> sizes;
+  // Block being bumped through and the offset in it
+  ulong current;
+  ulong used;
+
+  void *allocateSlow(const ulong, const ulong);
+
+public:
+  calcArena() : current(0), used(0) {}
+  calcArena(const calcArena &) = delete;
+  calcArena &operator=(const calcArena &) = delete;
+  ~calcArena() {
+    for (char *b : this->blocks)
+      free(b);
+  }
+
+  void *allocate(const ulong bytes, const ulong align) {
+    if (this->current < this->blocks.size()) {
+      const ulong start = (this->used + align - 1) & ~(align - 1);
+      if (start + bytes <= this->sizes[this->current]) {
+        this->used = start + bytes;
+        return this->blocks[this->current] + start;
+      }
+    }
+    return this->allocateSlow(bytes, align);
+  }
+  // Everything allocated so far is given up
+  void reset() {
+    this->current = 0;
+    this->used = 0;
+  }
+  // Bytes held by the arena
+  ulong capacity() const {
+    ulong n = 0;
+    for (ulong s : this->sizes)
+      n += s;
+    return n;
+  }
+};
+
+inline void *calcArena::allocateSlow(const ulong bytes, const ulong align) {
+  // Blocks left over from before the last reset() are used again first
+  while (++this->current < this->blocks.size()) {
+    this->used = 0;
+    if (bytes + align <= this->sizes[this->current])
+      return this->allocate(bytes, align);
+  }
+  const ulong size = bytes + align > blockSize ? bytes + align : blockSize;
+  char *b = (char *)malloc(size);
+  if (b == NULL)
+    throw std::bad_alloc();
+  this->blocks.push_back(b);
+  this->sizes.push_back(size);
+  this->current = this->blocks.size() - 1;
+  this->used = 0;
+  return this->allocate(bytes, align);
+}
+
+// Allocator for standard containers. Containers made with an arena take their
+// memory from it and never give it back, the rest use new and delete.
+template <typename T> class arenaAllocator {
+  template <typename U> friend class arenaAllocator;
+  calcArena *arena;
+
+public:
+  typedef T value_type;
+
+  arenaAllocator(calcArena *a = NULL) : arena(a) {}
+  template <typename U>
+  arenaAllocator(const arenaAllocator<U> &o) : arena(o.arena) {}
+
+  T *allocate(const size_t n) {
+    if (this->arena)
+      return (T *)this->arena->allocate(n * sizeof(T), alignof(T));
+    return (T *)::operator new(n * sizeof(T));
+  }
+  void deallocate(T *p, const size_t) {
+    if (not this->arena)
+      ::operator delete(p);
+  }
+  template <typename U> bool operator==(const arenaAllocator<U> &o) const {
+    return this->arena == o.arena;
+  }
+  template <typename U> bool operator!=(const arenaAllocator<U> &o) const {
+    return this->arena != o.arena;
+  }
+};
+
+#endif
+
+/*
+  Local Variables:
+  mode: c++
+  c-file-offset: 2
+  fill-column: 80
+  End:
+*/
@@ -0,0 +1,168 @@
+#ifndef CALC_BATCH_H
+#define CALC_BATCH_H
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+#include "calcParser.hpp"
+
+// Evaluates a batch of lines on a pool of threads. Lines referring to answers
+// (a0, a12, ...) depend on the lines before them, so they are only marked and
+// left for the caller to evaluate in order. Nothing else reads or writes the
+// answers, so the rest are evaluated in any order and with storeAnswers off.
+// The calling thread evaluates in the caller's calcContext and every other
+// thread in its own one with the same angle unit.
+template <typename numT> class calcBatch {
+public:
+  struct line {
+    constStr text;
+    ulong len;
+    // Has to be evaluated in order by the caller
+    bool dependent;
+    ERROR e;
+    bool hasAns;
+    numT ans;
+  };
+
+private:
+  // Lines handed to a thread at once
+  static const ulong grain = 64;
+
+  std::vector<std::thread> workers;
+  std::mutex lock;
+  std::condition_variable wake, done;
+  std::vector<line> *lines;
+  std::atomic<ulong> next;
+  // Incremented for every batch so that workers notice new work
+  ulong generation;
+  uint busy;
+  bool quit;
+  // Angle unit of the batch
+  uint8_t angle;
+
+  void work();
+  void evaluateSome(std::vector<line> &, calcContext<numT> &);
+
+public:
+  // threads includes the calling thread, which also evaluates. 0 uses every
+  // core.
+  explicit calcBatch(uint threads = 0);
+  ~calcBatch();
+  uint threadCount() const { return this->workers.size() + 1; }
+  // True if the text has an answer reference
+  static bool refersToAns(constStr, const ulong);
+  // Set line::dependent and evaluate the independent lines in the context
+  void evaluate(std::vector<line> &, calcContext<numT> &);
+};
+
+template <typename numT> calcBatch<numT>::calcBatch(uint threads)
+    : lines(NULL), next(0), generation(0), busy(0), quit(false), angle(DEG) {
+  if (threads == 0)
+    threads = std::thread::hardware_concurrency();
+  for (uint i = 1; i < threads; ++i)
+    this->workers.emplace_back(&calcBatch::work, this);
+}
+
+template <typename numT> calcBatch<numT>::~calcBatch() {
+  {
+    std::lock_guard<std::mutex> l(this->lock);
+    this->quit = true;
+  }
+  this->wake.notify_all();
+  for (std::thread &t : this->workers)
+    t.join();
+}
+
+template <typename numT>
+bool calcBatch<numT>::refersToAns(constStr text, const ulong len) {
+  // Same test as calcParse::isAns(). A false positive only costs parallelism.
+  constStr end = text + len;
+  for (constStr c = text; c < end;) {
+    c = (constStr)memchr(c, 'a', end - c);
+    if (c == NULL)
+      return false;
+    if (++c < end && isdigit(*c))
+      return true;
+  }
+  return false;
+}
+
+template <typename numT>
+void calcBatch<numT>::evaluateSome(std::vector<line> &l,
+                                   calcContext<numT> &context) {
+  ulong i;
+  while ((i = this->next.fetch_add(grain)) < l.size()) {
+    for (ulong end = std::min(i + grain, (ulong)l.size()); i < end; ++i) {
+      if (l[i].dependent)
+        continue;
+      calcParse<numT> parser(context, l[i].text, l[i].len);
+      parser.storeAnswers = false;
+      l[i].e = parser.tryParsing();
+      l[i].hasAns = not l[i].e.isSet() && parser.hasAns();
+      l[i].ans = parser.Ans();
+    }
+  }
+}
+
+template <typename numT> void calcBatch<numT>::work() {
+  calcContext<numT> context;
+  ulong seen = 0;
+  std::vector<line> *batch;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> l(this->lock);
+      this->wake.wait(l, [&] { return quit || generation != seen; });
+      if (this->quit)
+        return;
+      seen = this->generation;
+      // Woke up after the batch was over
+      if ((batch = this->lines) == NULL)
+        continue;
+      context.angle = this->angle;
+      ++this->busy;
+    }
+    this->evaluateSome(*batch, context);
+    {
+      std::lock_guard<std::mutex> l(this->lock);
+      --this->busy;
+    }
+    this->done.notify_one();
+  }
+}
+
+template <typename numT>
+void calcBatch<numT>::evaluate(std::vector<line> &batch,
+                              calcContext<numT> &context) {
+  for (line &l : batch)
+    l.dependent = refersToAns(l.text, l.len);
+
+  {
+    std::lock_guard<std::mutex> l(this->lock);
+    this->lines = &batch;
+    this->angle = context.angle;
+    this->next = 0;
+    ++this->generation;
+  }
+  this->wake.notify_all();
+  this->evaluateSome(batch, context);
+
+  // Workers which haven't picked up the batch yet never will, as lines is
+  // cleared before the lock is released
+  std::unique_lock<std::mutex> l(this->lock);
+  this->done.wait(l, [&] { return busy == 0; });
+  this->lines = NULL;
+}
+
+#endif
+
+/*
+  Local Variables:
+  mode: c++
+  c-file-offset: 2
+  fill-column: 80
+  End:
+*/
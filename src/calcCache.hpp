@@ -0,0 +1,183 @@
+#ifndef CALC_CACHE_H
+#define CALC_CACHE_H
+
+#include <condition_variable>
+#include <ctype.h>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "common.hpp"
+
+// Answers of expressions which don't depend on the answers before them, shared
+// by every session. Such an expression means the same for everybody with the
+// same angle unit, so key() makes that and the text into the key. Runs of
+// spaces become one and spaces at the ends go, but spaces between tokens stay
+// as they may matter: "-3" is a number where "- 3" is an error.
+//
+// The keys are spread over shards, each with a lock of its own and the least
+// recently used answers going first. A thread which finds no answer for its key
+// is the one to compute it, and its claim fills the key after or abandons it
+// when it goes, even by an exception. Others asking for the key meanwhile wait
+// for that instead of computing it again.
+class calcCache {
+  static const uint shardCount = 16;
+
+  struct entry {
+    float64_t ans = 0;
+    bool ready = false;
+    // Where it is in order once ready
+    std::list<const std::string *>::iterator at;
+  };
+
+  struct shard {
+    std::mutex lock;
+    // Somebody filled or abandoned a key
+    std::condition_variable done;
+    std::unordered_map<std::string, entry> entries;
+    // Ready ones, most recently used first. Keys are those of entries, which
+    // don't move.
+    std::list<const std::string *> order;
+    char apart[64];
+  };
+
+  shard shards[shardCount];
+  ulong perShard;
+
+  shard &of(const std::string &key) {
+    return this->shards[std::hash<std::string>()(key) % shardCount];
+  }
+
+  // The key find() left to the caller has no answer
+  void abandon(const std::string &key);
+
+public:
+  // A key left to its holder by find()
+  class claim {
+    calcCache *cache = NULL;
+    const std::string *key = NULL;
+    friend class calcCache;
+
+  public:
+    claim() = default;
+    claim(const claim &) = delete;
+    claim &operator=(const claim &) = delete;
+    ~claim() {
+      if (this->cache)
+        this->cache->abandon(*this->key);
+    }
+    // The answer of the key, which is abandoned if it isn't filled
+    void fill(const float64_t ans) {
+      if (this->cache)
+        this->cache->fill(*this->key, ans);
+      this->cache = NULL;
+    }
+  };
+
+  // Room for about size answers. 0 keeps none.
+  explicit calcCache(const ulong size = 0) { this->resize(size); }
+  calcCache(const calcCache &) = delete;
+  calcCache &operator=(const calcCache &) = delete;
+
+  // Before the cache is used
+  void resize(const ulong size) {
+    this->perShard = (size + shardCount - 1) / shardCount;
+  }
+  bool isOn() const { return this->perShard > 0; }
+
+  // The key of the expression in [start, end) with answers in angle unit.
+  // False if the expression refers to answers, or is a comment or nothing.
+  static bool key(const uint8_t angle, constStr start, constStr end,
+                  std::string &key);
+
+  // True with the answer of key, waiting for it if somebody is computing it.
+  // False if the caller is to compute it, with c holding key until then. key
+  // has to outlive c.
+  bool find(const std::string &key, float64_t &ans, claim &c);
+  // The answer of a key find() left to the caller
+  void fill(const std::string &key, const float64_t ans);
+};
+
+inline bool calcCache::key(const uint8_t angle, constStr start, constStr end,
+                           std::string &key) {
+  while (start < end && isspace(*start))
+    ++start;
+  while (end > start && isspace(end[-1]))
+    --end;
+  if (start == end || *start == '#')
+    return false;
+  key.assign(1, (char)angle);
+  for (constStr c = start; c < end; ++c) {
+    // Answers look like a12
+    if (*c == 'a' && c + 1 < end && isdigit(c[1]))
+      return false;
+    if (not isspace(*c))
+      key += *c;
+    else if (not isspace(c[-1]))
+      key += ' ';
+  }
+  return true;
+}
+
+inline bool calcCache::find(const std::string &key, float64_t &ans,
+                            claim &c) {
+  shard &s = this->of(key);
+  std::unique_lock<std::mutex> l(s.lock);
+  auto i = s.entries.find(key);
+  while (i != s.entries.end() && not i->second.ready) {
+    s.done.wait(l);
+    i = s.entries.find(key);
+  }
+  if (i != s.entries.end()) {
+    s.order.splice(s.order.begin(), s.order, i->second.at);
+    ans = i->second.ans;
+    return true;
+  }
+  s.entries.emplace(key, entry());
+  c.cache = this;
+  c.key = &key;
+  return false;
+}
+
+inline void calcCache::fill(const std::string &key, const float64_t ans) {
+  shard &s = this->of(key);
+  {
+    std::lock_guard<std::mutex> l(s.lock);
+    auto i = s.entries.find(key);
+    if (i == s.entries.end() || i->second.ready)
+      return;
+    i->second.ans = ans;
+    i->second.ready = true;
+    s.order.push_front(&i->first);
+    i->second.at = s.order.begin();
+    while (s.order.size() > this->perShard) {
+      auto last = s.entries.find(*s.order.back());
+      s.order.pop_back();
+      s.entries.erase(last);
+    }
+  }
+  s.done.notify_all();
+}
+
+inline void calcCache::abandon(const std::string &key) {
+  shard &s = this->of(key);
+  {
+    std::lock_guard<std::mutex> l(s.lock);
+    auto i = s.entries.find(key);
+    if (i == s.entries.end() || i->second.ready)
+      return;
+    s.entries.erase(i);
+  }
+  s.done.notify_all();
+}
+
+#endif
+
+/*
+  Local Variables:
+  mode: c++
+  c-file-offset: 2
+  fill-column: 80
+  End:
+*/
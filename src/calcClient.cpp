@@ -0,0 +1,251 @@
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "calcClient.hpp"
+
+// How long to sleep on a ring before looking whether the server is still there
+static const long patience = 100000000;
+
+calcClient::calcClient() : fd(-1), memory(NULL) {}
+
+calcClient::~calcClient() { this->close(); }
+
+void calcClient::close() {
+  if (this->memory != NULL)
+    munmap(this->memory, calcChannel::bytes());
+  this->memory = NULL;
+  if (this->fd >= 0)
+    ::close(this->fd);
+  this->fd = -1;
+  this->in.clear();
+}
+
+bool calcClient::finish() {
+  return this->fd >= 0 && shutdown(this->fd, SHUT_WR) == 0;
+}
+
+bool calcClient::connect(const std::string &host, const int port) {
+  this->close();
+  addrinfo hints, *found;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  const std::string service = std::to_string(port);
+  if (getaddrinfo(host.c_str(), service.c_str(), &hints, &found))
+    return false;
+  for (addrinfo *a = found; a != NULL && this->fd < 0; a = a->ai_next) {
+    this->fd = socket(a->ai_family, a->ai_socktype | SOCK_CLOEXEC,
+                      a->ai_protocol);
+    if (this->fd >= 0 && ::connect(this->fd, a->ai_addr, a->ai_addrlen) < 0)
+      this->close();
+  }
+  freeaddrinfo(found);
+  return this->fd >= 0;
+}
+
+bool calcClient::connect(const std::string &path) {
+  this->close();
+  sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  if (path.size() >= sizeof(address.sun_path))
+    return false;
+  address.sun_family = AF_UNIX;
+  strcpy(address.sun_path, path.c_str());
+  this->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (this->fd >= 0 &&
+      ::connect(this->fd, (sockaddr *)&address, sizeof(address)) < 0)
+    this->close();
+  return this->fd >= 0;
+}
+
+bool calcClient::send(const std::string &line) {
+  const std::string l = line + '\n';
+  for (ulong sent = 0; sent < l.size();) {
+    // A server gone away is an EPIPE, not a signal killing the program
+    const ssize_t n =
+        ::send(this->fd, l.data() + sent, l.size() - sent, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    sent += n;
+  }
+  return true;
+}
+
+bool calcClient::receive(std::string &reply) {
+  ulong nl;
+  while ((nl = this->in.find('\n')) == std::string::npos) {
+    char buf[4096];
+    const ssize_t n = read(this->fd, buf, sizeof(buf));
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    this->in.append(buf, n);
+  }
+  reply.assign(this->in, 0, nl);
+  this->in.erase(0, nl + 1);
+  return true;
+}
+
+bool calcClient::ask(const std::string &line, std::string &reply) {
+  return this->send(line) && this->receive(reply);
+}
+
+bool calcClient::attach() {
+  if (this->fd < 0 || this->memory != NULL)
+    return false;
+  const ulong size = calcChannel::bytes();
+  const int shm = memfd_create("calcChannel", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (shm < 0)
+    return false;
+  void *m = MAP_FAILED;
+  // The server only takes memory which can't shrink
+  if (ftruncate(shm, size) == 0 &&
+      fcntl(shm, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_SEAL) == 0)
+    m = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, shm, 0);
+  if (m == MAP_FAILED) {
+    ::close(shm);
+    return false;
+  }
+  calcRing::format(m, calcChannel::ringSize);
+  calcRing::format((char *)m + calcRing::bytes(calcChannel::ringSize),
+                   calcChannel::ringSize);
+
+  char line[] = "SHM\n";
+  iovec v = {line, 4};
+  char control[CMSG_SPACE(sizeof(int))];
+  memset(control, 0, sizeof(control));
+  msghdr message;
+  memset(&message, 0, sizeof(message));
+  message.msg_iov = &v;
+  message.msg_iovlen = 1;
+  message.msg_control = control;
+  message.msg_controllen = sizeof(control);
+  cmsghdr *h = CMSG_FIRSTHDR(&message);
+  h->cmsg_level = SOL_SOCKET;
+  h->cmsg_type = SCM_RIGHTS;
+  h->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(h), &shm, sizeof(int));
+  const bool sent = sendmsg(this->fd, &message, MSG_NOSIGNAL) == 4;
+  ::close(shm);
+
+  std::string reply;
+  if (not sent || not this->receive(reply) || reply != "{ \"shm\": true }") {
+    munmap(m, size);
+    this->close();
+    return false;
+  }
+  this->memory = m;
+  this->requests = calcChannel::requests(m);
+  this->replies = calcChannel::replies(m);
+  return true;
+}
+
+// The server hasn't closed the connection
+bool calcClient::alive() const {
+  pollfd p = {this->fd, POLLRDHUP, 0};
+  return poll(&p, 1, 0) == 0;
+}
+
+// Room for a request, waiting for the server to make it. NULL if it's gone.
+void *calcClient::reserve(const uint32_t type, const ulong bytes) {
+  if (this->memory == NULL || bytes > this->requests.maxRecord())
+    return NULL;
+  void *p;
+  while ((p = this->requests.reserve(type, bytes)) == NULL) {
+    if (not this->requests.waitUntil(
+            [this, bytes] { return this->requests.hasRoom(bytes); },
+            patience) &&
+        not this->alive())
+      return NULL;
+  }
+  return p;
+}
+
+bool calcClient::sendEvaluate(constStr expression, const ulong length) {
+  char *p = (char *)this->reserve(calcChannel::evaluate, length);
+  if (p == NULL)
+    return false;
+  memcpy(p, expression, length);
+  this->requests.commit();
+  return true;
+}
+
+bool calcClient::sendPrepare(const std::string &id,
+                             const std::string &expression) {
+  char *p = (char *)this->reserve(calcChannel::prepare,
+                                  id.size() + 1 + expression.size());
+  if (p == NULL)
+    return false;
+  memcpy(p, id.c_str(), id.size() + 1);
+  memcpy(p + id.size() + 1, expression.data(), expression.size());
+  this->requests.commit();
+  return true;
+}
+
+bool calcClient::sendExec(const std::string &id, const float64_t *values,
+                          const ulong n) {
+  calcChannel::execRequest e;
+  e.count = n;
+  e.idLength = id.size();
+  const ulong bytes = n * sizeof(float64_t);
+  char *p = (char *)this->reserve(calcChannel::exec,
+                                  sizeof(e) + bytes + id.size());
+  if (p == NULL)
+    return false;
+  memcpy(p, &e, sizeof(e));
+  memcpy(p + sizeof(e), values, bytes);
+  memcpy(p + sizeof(e) + bytes, id.data(), id.size());
+  this->requests.commit();
+  return true;
+}
+
+bool calcClient::receive(result &r) {
+  if (this->memory == NULL)
+    return false;
+  recordHeader h;
+  const char *p;
+  while ((p = this->replies.peek(h)) == NULL) {
+    if (this->replies.isBroken())
+      return false;
+    if (not this->replies.waitUntil(
+            [this] { return not this->replies.isEmpty(); }, patience) &&
+        not this->alive())
+      return false;
+  }
+  calcChannel::reply reply;
+  if (h.size < sizeof(reply))
+    return false;
+  memcpy(&reply, p, sizeof(reply));
+  this->replies.release();
+  r.e.set(reply.error);
+  r.hasPosition = reply.flags & calcChannel::hasPosition;
+  r.position = reply.position;
+  r.hasAns = reply.flags & calcChannel::hasAns;
+  r.ans = reply.ans;
+  return true;
+}
+
+bool calcClient::evaluate(const std::string &expression, result &r) {
+  return this->sendEvaluate(expression.data(), expression.size()) &&
+         this->receive(r);
+}
+
+bool calcClient::prepare(const std::string &id, const std::string &expression,
+                         result &r) {
+  return this->sendPrepare(id, expression) && this->receive(r);
+}
+
+bool calcClient::exec(const std::string &id, const float64_t *values,
+                      const ulong n, result &r) {
+  return this->sendExec(id, values, n) && this->receive(r);
+}
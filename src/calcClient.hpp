@@ -0,0 +1,84 @@
+#ifndef CALC_CLIENT_H
+#define CALC_CLIENT_H
+
+#include <string>
+
+#include "calcError.hpp"
+#include "calcRing.hpp"
+
+// A connection to calcServer, over TCP or its unix socket. Requests are lines
+// and replies come back as lines in the same order, so many of them may be
+// sent before reading any reply.
+//
+// Over the unix socket attach() moves the connection to shared memory, after
+// which requests go through evaluate(), prepare() and exec() or their send and
+// receive halves instead of lines.
+class calcClient {
+public:
+  struct result {
+    ERROR e;
+    bool hasPosition;
+    ulong position;
+    // False for comments
+    bool hasAns;
+    float64_t ans;
+  };
+
+private:
+  int fd;
+  // Received and not yet returned as a line
+  std::string in;
+  void *memory;
+  calcRing requests;
+  calcRing replies;
+
+  void *reserve(const uint32_t, const ulong);
+  bool alive() const;
+
+public:
+  calcClient();
+  calcClient(const calcClient &) = delete;
+  calcClient &operator=(const calcClient &) = delete;
+  ~calcClient();
+
+  bool connect(const std::string &host, const int port);
+  // The unix socket at path
+  bool connect(const std::string &path);
+  bool isConnected() const { return this->fd >= 0; }
+  void close();
+  // Tell the server no more requests are coming. Their replies still are.
+  bool finish();
+
+  // Lines
+  bool send(const std::string &line);
+  // The next reply without its newline
+  bool receive(std::string &reply);
+  bool ask(const std::string &line, std::string &reply);
+
+  // Shared memory. Returns false if the server didn't take it, which drops
+  // the connection.
+  bool attach();
+  bool isAttached() const { return this->memory != NULL; }
+  // Requests which are answered in order by receive(result &)
+  bool sendEvaluate(constStr, const ulong);
+  bool sendPrepare(const std::string &id, const std::string &expression);
+  // values are bound to the first n variables of id in the order they appear
+  // in its expression
+  bool sendExec(const std::string &id, const float64_t *values, const ulong n);
+  bool receive(result &);
+  // Send one and wait for its answer. The ans of prepare is its number of
+  // variables.
+  bool evaluate(const std::string &expression, result &);
+  bool prepare(const std::string &id, const std::string &expression, result &);
+  bool exec(const std::string &id, const float64_t *, const ulong, result &);
+};
+
+#endif
+
+/*
+  Local Variables:
+  mode: c++
+  c-file-offset: 2
+  fill-column: 80
+  End:
+*/
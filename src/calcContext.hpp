@@ -0,0 +1,55 @@
+#ifndef CALC_CONTEXT_H
+#define CALC_CONTEXT_H
+
+#include "answerManager.hpp"
+#include "calcArena.hpp"
+#include "calcOptr.hpp"
+
+template <typename numT> class calcParse;
+
+// Everything an evaluator keeps between expressions: the answers, the angle
+// unit and the memory reused by the expressions evaluated one after another.
+// Nothing is shared between contexts, so evaluators with their own context
+// run at the same time without locks.
+//
+// A parser made with a context uses the context's stacks instead of its own,
+// and compiling simplifies the program in the context's arena. Both are
+// emptied, but not freed, when the next parser is made. Once they have grown
+// to fit the largest expression, evaluating allocates nothing.
+//
+// A context is used by a single parser at a time, so keep one per thread or
+// per session.
+template <typename numT> class calcContext {
+  operatorManager<numT> optr;
+  calcArena arena;
+
+  template <typename num> friend class calcParse;
+
+  // Called by each parser made with this context
+  void begin() {
+    this->optr.reset();
+    this->optr.setAngle(this->angle);
+    this->arena.reset();
+  }
+
+public:
+  answerManager<numT> answers;
+  // Angle unit of trigonometric functions: RAD, DEG or GRAD
+  uint8_t angle;
+
+  calcContext() : angle(DEG) {}
+  calcContext(const calcContext &) = delete;
+  calcContext &operator=(const calcContext &) = delete;
+  // Bytes held by the arena
+  ulong arenaSize() const { return this->arena.capacity(); }
+};
+
+#endif
+
+/*
+  Local Variables:
+  mode: c++
+  c-file-offset: 2
+  fill-column: 80
+  End:
+*/
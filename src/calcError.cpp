@@ -26,12 +26,16 @@ constStr ERROR::toString() const {
   case invalidAns:  return "Invalid Answer";
   case invalidCmd:  return "Invalid command";
   case sizeError:   return "Size out of bounds";
+  case varUndef:    return "Undefined variable";
+  case ioError:     return "Input/Output error";
   default:          return "Undefined Error. Please report this event.";
   }
 }
 
 bool ERROR::isSet() const { return this->e; }
 
+signed char ERROR::code() const { return this->e; }
+
 void ERROR::set(const signed char error) { this->e = error; }
 
 void ERROR::reset() { this->e = noError; }
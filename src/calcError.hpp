@@ -18,6 +18,15 @@
 #define error(err_type)  throw new ERROR(ERROR::err_type);
 #endif
 
+// Functions returning their error as an ERROR instead of throwing it use these.
+// CALC_FAIL() returns the error and CALC_TRY() returns early if expr failed.
+#define CALC_FAIL(err_type) return ERROR(ERROR::err_type)
+#define CALC_TRY(expr) {                                                \
+    const ERROR e_ = (expr);                                            \
+    if (e_.isSet())                                                     \
+      return e_;                                                        \
+  }
+
 class ERROR {
 private:
   signed char e;
@@ -40,10 +49,13 @@ public:
     parseError = -11,
     invalidAns = -12,
     invalidCmd = -13,
-    sizeError = -14
+    sizeError = -14,
+    varUndef = -15,
+    ioError = -16
   };
   constStr toString() const;
   bool isSet() const;
+  signed char code() const;
   void set(const signed char);
   void reset();
   const ERROR operator=(int);
@@ -0,0 +1,206 @@
+#ifndef CALC_LOG_H
+#define CALC_LOG_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <thread>
+#include <time.h>
+#include <vector>
+
+#include "calcPerThread.hpp"
+
+// A log which never makes the thread writing to it wait. Every thread has a
+// ring of its own which only it writes and only the flusher thread reads, so
+// a message costs its formatting and nothing else. The flusher prints what
+// the rings hold every few milliseconds. A message finding its ring full is
+// dropped and counted instead.
+//
+// Messages below the level aren't formatted at all, and only one in every
+// sample of those at debug is kept. Lines are logfmt:
+//   time=1700000000.123456 level=info thread=1 peer=127.0.0.1:4242 msg="Welcome"
+class calcLog {
+public:
+  enum level : uint8_t { debug, info, warning, error, off };
+
+private:
+  struct entry {
+    float64_t time;
+    level l;
+    char peer[47];
+    // Longer messages are cut
+    char text[200];
+  };
+
+  struct ring {
+    static const ulong size = 2048;
+    // Apart so that the writer and the flusher don't share a cache line
+    std::atomic<ulong> head{0};
+    char apart[64];
+    std::atomic<ulong> tail{0};
+    std::atomic<ulong> dropped{0};
+    // Debug messages seen by the writer, for sampling
+    ulong seen = 0;
+    entry entries[size];
+  };
+
+  std::atomic<uint8_t> minimum{info};
+  std::atomic<ulong> sample{1};
+  FILE *out = stdout;
+  calcPerThread<ring> rings;
+  std::mutex flushLock;
+  std::condition_variable wake;
+  bool stopping = false;
+  std::thread flusher;
+
+  void flush();
+  void run();
+  static void print(FILE *, const entry &, const uint);
+
+public:
+  calcLog() {}
+  calcLog(const calcLog &) = delete;
+  calcLog &operator=(const calcLog &) = delete;
+  ~calcLog() { this->stop(); }
+
+  static constStr name(const level);
+  // The level called name, off if there is none
+  static level find(constStr name);
+
+  void setLevel(const level l) { this->minimum = l; }
+  // Keep one in every n debug messages
+  void setSampling(const ulong n) { this->sample = n ? n : 1; }
+  bool wants(const level l) const {
+    return l >= this->minimum.load(std::memory_order_relaxed);
+  }
+
+  // Start flushing to out. Messages before this wait in their rings.
+  void start(FILE *out = stdout);
+  // Flush everything and stop the flusher
+  void stop();
+
+  void write(const level, constStr peer, constStr format, ...)
+      __attribute__((format(printf, 4, 5)));
+  void write(const level, constStr peer, constStr format, va_list);
+};
+
+inline constStr calcLog::name(const level l) {
+  static constStr names[] = {"debug", "info", "warning", "error", "off"};
+  return names[l <= off ? l : off];
+}
+
+inline calcLog::level calcLog::find(constStr name) {
+  for (uint8_t l = debug; l < off; ++l)
+    if (not strcmp(name, calcLog::name((level)l)))
+      return (level)l;
+  return off;
+}
+
+inline void calcLog::write(const level l, constStr peer, constStr format, ...) {
+  va_list args;
+  va_start(args, format);
+  this->write(l, peer, format, args);
+  va_end(args);
+}
+
+inline void calcLog::write(const level l, constStr peer, constStr format,
+                           va_list args) {
+  if (not this->wants(l))
+    return;
+  ring &r = this->rings.mine();
+  if (l == debug && r.seen++ % this->sample.load(std::memory_order_relaxed))
+    return;
+  const ulong head = r.head.load(std::memory_order_relaxed);
+  if (head - r.tail.load(std::memory_order_acquire) == ring::size) {
+    r.dropped.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  entry &e = r.entries[head % ring::size];
+  timespec t;
+  clock_gettime(CLOCK_REALTIME, &t);
+  e.time = t.tv_sec + t.tv_nsec / 1e9;
+  e.l = l;
+  snprintf(e.peer, sizeof(e.peer), "%s", peer ? peer : "");
+  vsnprintf(e.text, sizeof(e.text), format, args);
+  r.head.store(head + 1, std::memory_order_release);
+}
+
+inline void calcLog::print(FILE *out, const entry &e, const uint thread) {
+  fprintf(out, "time=%.6f level=%s thread=%u", e.time, name(e.l), thread);
+  if (e.peer[0])
+    fprintf(out, " peer=%s", e.peer);
+  fputs(" msg=\"", out);
+  for (constStr c = e.text; *c; ++c) {
+    if (*c == '"' || *c == '\\')
+      fputc('\\', out);
+    fputc((uchar)*c < ' ' ? ' ' : *c, out);
+  }
+  fputs("\"\n", out);
+}
+
+inline void calcLog::flush() {
+  this->rings.each([this](ring &r, const uint id) {
+    ulong tail = r.tail.load(std::memory_order_relaxed);
+    const ulong head = r.head.load(std::memory_order_acquire);
+    for (; tail != head; ++tail)
+      print(this->out, r.entries[tail % ring::size], id);
+    r.tail.store(tail, std::memory_order_release);
+    const ulong dropped = r.dropped.exchange(0, std::memory_order_relaxed);
+    if (dropped)
+      fprintf(this->out,
+              "time=%.6f level=warning thread=%u msg=\"%lu messages dropped\"\n",
+              std::chrono::duration<double>(
+                  std::chrono::system_clock::now().time_since_epoch())
+                  .count(),
+              id, dropped);
+  });
+  fflush(this->out);
+}
+
+inline void calcLog::run() {
+  std::unique_lock<std::mutex> l(this->flushLock);
+  while (not this->stopping) {
+    this->wake.wait_for(l, std::chrono::milliseconds(20));
+    this->flush();
+  }
+  this->flush();
+}
+
+inline void calcLog::start(FILE *out) {
+  if (this->flusher.joinable())
+    return;
+  this->out = out;
+  this->stopping = false;
+  // Signals are left to the threads doing the work
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  this->flusher = std::thread(&calcLog::run, this);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+inline void calcLog::stop() {
+  if (not this->flusher.joinable())
+    return;
+  {
+    std::lock_guard<std::mutex> l(this->flushLock);
+    this->stopping = true;
+  }
+  this->wake.notify_one();
+  this->flusher.join();
+}
+
+#endif
+
+/*
+  Local Variables:
+  mode: c++
+  c-file-offset: 2
+  fill-column: 80
+  End:
+*/
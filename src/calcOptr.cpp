@@ -1,39 +1,154 @@
 #include <ctype.h>
+#include <string.h>
 
 #include "calcOptr.hpp"
 
-uint8_t angle_type = DEG;
+// Properties of every operator indexed by Operator::optrCode
+struct optrInfo {
+  char name[7];
+  optr_hash hash;
+  bool isBinary;
+  uint8_t priority;
+};
 
-static const char bin_ops[22][4] = {
-  "+", "-", "*",  "/",  "^",  "|",  "&", "P",   "C",  ">>", "<<",
-  "<", ">", ">=", "<=", "==", "!=", "%", "log", "&&", "||", ""
+/*
+  priority list:
+  const char operators[][5][4] = {
+  { "&&", "||" },
+  { ">", "<", ">=", "<=", "==", "!=" },
+  { "+", "-" },
+  { "*", "/" },
+  { "%", "^" },
+  { "P", "C", "log" },
+  { "&", "|" },
+  { ">>", "<<" }
+  };
+*/
+static constexpr optrInfo optrs[Operator::C_count] = {
+  {"+", Operator::H_plus, true, 3},
+  {"-", Operator::H_minus, true, 3},
+  {"*", Operator::H_multiply, true, 4},
+  {"/", Operator::H_divide, true, 4},
+  {"^", Operator::H_pow, true, 5},
+  {"%", Operator::H_mod, true, 5},
+  {"P", Operator::H_P, true, 6},
+  {"C", Operator::H_C, true, 6},
+  {"&", Operator::H_bitAnd, true, 7},
+  {"|", Operator::H_bitOr, true, 7},
+  {">>", Operator::H_bitShiftRight, true, 8},
+  {"<<", Operator::H_bitShiftLeft, true, 8},
+  {"&&", Operator::H_and, true, 1},
+  {"||", Operator::H_or, true, 1},
+  {">", Operator::H_great, true, 2},
+  {"<", Operator::H_less, true, 2},
+  {">=", Operator::H_greatEqual, true, 2},
+  {"<=", Operator::H_lessEqual, true, 2},
+  {"==", Operator::H_equal, true, 2},
+  {"!=", Operator::H_notEqual, true, 2},
+  {"log", Operator::H_log, true, 6},
+  {"~", Operator::H_bitNot, false, 0},
+  {"!", Operator::H_not, false, 0},
+  {"sin", Operator::H_sin, false, 0},
+  {"cos", Operator::H_cos, false, 0},
+  {"tan", Operator::H_tan, false, 0},
+  {"sec", Operator::H_sec, false, 0},
+  {"cosec", Operator::H_cosec, false, 0},
+  {"cot", Operator::H_cot, false, 0},
+  {"asin", Operator::H_asin, false, 0},
+  {"acos", Operator::H_acos, false, 0},
+  {"atan", Operator::H_atan, false, 0},
+  {"asec", Operator::H_asec, false, 0},
+  {"acosec", Operator::H_acosec, false, 0},
+  {"acot", Operator::H_acot, false, 0},
+  {"sinh", Operator::H_sinh, false, 0},
+  {"cosh", Operator::H_cosh, false, 0},
+  {"tanh", Operator::H_tanh, false, 0},
+  {"ln", Operator::H_ln, false, 0},
+  {"logten", Operator::H_logten, false, 0},
+  {"abs", Operator::H_abs, false, 0},
+  {"floor", Operator::H_floor, false, 0},
+  {"ceil", Operator::H_ceil, false, 0},
+  {"(", Operator::H_openBracket, false, 0},
+  {")", Operator::H_closeBracket, false, 0}
 };
 
-static const char un_ops[22][7] = {
-  "~",      "!",     "ln",   "abs",   "cos",  "sin",  "tan",    "acos",
-  "asin",   "atan",  "sec",  "cosec", "cot",  "asec", "acosec", "acot",
-  "logten", "floor", "sinh", "cosh",  "tanh", "ceil"
+static constexpr ulong unify = 999999999;
+
+static constexpr str_hash generateHashKey(constStr s, str_hash hash = 0) {
+  return *s ? generateHashKey(s + 1, 127 * hash + *s) : hash % unify;
+}
+
+static constexpr bool hashesMatch() {
+  for (uint i = 0; i < Operator::C_count; ++i)
+    if (generateHashKey(optrs[i].name) != optrs[i].hash)
+      return false;
+  return true;
+}
+
+static_assert(hashesMatch(), "Operator::optrHash doesn't match the names");
+
+// The smallest table size where no two operator hashes share a slot
+static constexpr uint perfectSize() {
+  for (uint size = Operator::C_count;; ++size) {
+    bool collides = false;
+    for (uint i = 0; i < Operator::C_count && not collides; ++i)
+      for (uint j = i + 1; j < Operator::C_count && not collides; ++j)
+        collides = optrs[i].hash % size == optrs[j].hash % size;
+    if (not collides)
+      return size;
+  }
+}
+
+static constexpr uint slotCount = perfectSize();
+
+// Perfect hash table of 1 + optrCode. Zero marks an empty slot.
+struct optrTable {
+  uint8_t slot[slotCount];
 };
 
-static optr_hash binOpsHash[22] = {0};
-static optr_hash unOpsHash[22] = {0};
+static constexpr optrTable makeOptrTable() {
+  optrTable t = {};
+  for (uint i = 0; i < Operator::C_count; ++i)
+    t.slot[optrs[i].hash % slotCount] = i + 1;
+  return t;
+}
+
+static constexpr optrTable table = makeOptrTable();
 
-static const ulong unify = 999999999;
+// One probe for the given hash. Returns Operator::C_count if it is unknown.
+static inline Operator::optrCode lookup(const optr_hash h) {
+  uint8_t i = table.slot[h % slotCount];
+  return i && optrs[i - 1].hash == h ? (Operator::optrCode)(i - 1)
+                                     : Operator::C_count;
+}
 
 Operator::Operator() {
   this->op = this->priority = 0;
   this->isBinary = false;
+  this->opCode = C_count;
 }
 
 Operator::Operator(optr_hash x) {
   this->op = x;
-  this->setOperatorProperties();
+  if (not this->setOperatorProperties()) {
+    this->op = this->priority = 0;
+    this->isBinary = 0;
+    this->opCode = C_count;
+  }
+}
+
+Operator::Operator(optrCode x) {
+  this->op = optrs[x].hash;
+  this->opCode = x;
+  this->isBinary = optrs[x].isBinary;
+  this->priority = optrs[x].priority;
 }
 
 Operator::Operator(constStr x) {
   if (not this->setFromString(x)) {
     this->op = this->priority = 0;
     this->isBinary = 0;
+    this->opCode = C_count;
   }
 }
 
@@ -48,6 +163,7 @@ Operator::Operator(const Operator &x) {
 #else
   this->isBinary = x.isBinary;
   this->priority = x.priority;
+  this->opCode = x.opCode;
 #endif
 }
 
@@ -59,6 +175,8 @@ bool Operator::isUnary() const {
   return not this->isBinary;
 }
 
+Operator::optrCode Operator::code() const { return this->opCode; }
+
 void Operator::operator=(const Operator &x) {
   this->op = x.op;
 #ifdef TESTING
@@ -70,23 +188,10 @@ void Operator::operator=(const Operator &x) {
 #else
   this->isBinary = x.isBinary;
   this->priority = x.priority;
+  this->opCode = x.opCode;
 #endif
 }
 
-static str_hash generateHashKey(constStr s, ulong start = 0, ulong end = 0) {
-  constStr x = s = s + start;
-  str_hash hash = 0;
-  if (start == end)
-    while (*x)
-      hash = 127 * hash + *(x++);
-  else if (start < end)
-    while (start < end)
-      hash = 127 * hash + *(x++), ++start;
-  else
-    return 0;
-  return hash;
-}
-
 double factorial(double x) {
   long double t = 1;
   for (long double i = 1; i <= x; i++)
@@ -102,112 +207,33 @@ bool ismathchar(const char ch) {
 
 bool isBracket(const char ch) { return (ch == '(' || ch == ')'); }
 
-static int priorityOf(const optr_hash s) {
-  /*
-    priority list:
-    const char operators[][5][4] = {
-    { "&&", "||" },
-    { ">", "<", ">=", "<=", "==", "!=" },
-    { "+", "-" },
-    { "*", "/" },
-    { "%", "^" },
-    { "P", "C", "log" },
-    { "&", "|" },
-    { ">>", "<<" }
-    };
-  */
-  switch (s) {
-  case Operator::H_and:
-  case Operator::H_or:
-    return 1;
-
-  case Operator::H_great:
-  case Operator::H_less:
-  case Operator::H_equal:
-  case Operator::H_notEqual:
-  case Operator::H_greatEqual:
-  case Operator::H_lessEqual:
-    return 2;
-
-  case Operator::H_plus:
-  case Operator::H_minus:
-    return 3;
-
-  case Operator::H_multiply:
-  case Operator::H_divide:
-    return 4;
-
-  case Operator::H_mod:
-  case Operator::H_pow:
-    return 5;
-
-  case Operator::H_P:
-  case Operator::H_C:
-  case Operator::H_log:
-    return 6;
-
-  case Operator::H_bitAnd:
-  case Operator::H_bitOr:
-    return 7;
-
-  case Operator::H_bitShiftRight:
-  case Operator::H_bitShiftLeft:
-    return 8;
-
-  default:
-    return 0;
-  }
-}
-
 bool Operator::setOperatorProperties() {
-  if (not op)
+  this->opCode = lookup(this->op);
+  if (this->opCode == C_count)
     return 0;
-  if (this->isBracket()) {
-    this->isBinary = false;
-    this->priority = priorityOf(this->op);
-    return 1;
-  } else {
-    uchar beg = 0, end = 20, mid;
-    while (beg <= end) {
-      mid = (beg + end) / 2;
-      if (this->op == binOpsHash[mid] || this->op == binOpsHash[beg] ||
-          this->op == binOpsHash[end]) {
-        isBinary = true;
-        this->priority = priorityOf(this->op);
-        return 1;
-      } else if (this->op < binOpsHash[mid])
-        end = mid - 1, ++beg;
-      else
-        beg = mid + 1, --end;
-    }
-    beg = 0, end = 21;
-    while (beg <= end) {
-      mid = (beg + end) / 2;
-      if (this->op == unOpsHash[mid] || this->op == unOpsHash[beg] ||
-          this->op == unOpsHash[end]) {
-        isBinary = false;
-        this->priority = priorityOf(this->op);
-        return 1;
-      } else if (this->op < unOpsHash[mid])
-        end = mid - 1, ++beg;
-      else
-        beg = mid + 1, --end;
-    }
-  }
-  return 0;
+  this->isBinary = optrs[this->opCode].isBinary;
+  this->priority = optrs[this->opCode].priority;
+  return 1;
 }
 
 // Parse the given string and return zero on error
 uint8_t Operator::parse(constStr &start) {
+  return this->parse(start, start + strnlen(start, 6));
+}
+
+// Same as above but doesn't read at or beyond end
+uint8_t Operator::parse(constStr &start, constStr end) {
   uint8_t charsRead = 0;
   str_hash hash = 0;
-  Operator optr;
-  for (uint i = 0; i < 6 && ismathchar(start[i]); ++i) {
+  optrCode c;
+  for (uint i = 0; i < 6 && start + i < end && ismathchar(start[i]); ++i) {
     hash = 127 * hash + start[i];
-    optr.op = hash % unify;
-    if (optr.setOperatorProperties()) {
-      // modify *this and charsRead iff optr is valid
-      *this = optr;
+    c = lookup(hash % unify);
+    // Different strings may share a hash, so the name is compared as well
+    if (c != C_count && not strncmp(optrs[c].name, start, i + 1) &&
+        not optrs[c].name[i + 1]) {
+      // modify *this and charsRead iff the operator is valid
+      *this = Operator(c);
       charsRead = i + 1;
     }
   }
@@ -216,125 +242,9 @@ uint8_t Operator::parse(constStr &start) {
 }
 
 constStr Operator::toString() const {
-  switch (this->op) {
-  case H_plus:
-    return "+";
-  case H_minus:
-    return "-";
-  case H_multiply:
-    return "*";
-  case H_divide:
-    return "/";
-  case H_pow:
-    return "^";
-  case H_mod:
-    return "%";
-  case H_P:
-    return "P";
-  case H_C:
-    return "C";
-  case H_bitAnd:
-    return "&";
-  case H_bitOr:
-    return "|";
-  case H_bitShiftRight:
-    return ">>";
-  case H_bitShiftLeft:
-    return "<<";
-  case H_bitNot:
-    return "~";
-  case H_openBracket:
-    return "(";
-  case H_closeBracket:
-    return ")";
-  case H_not:
-    return "!";
-  case H_and:
-    return "&&";
-  case H_or:
-    return "||";
-  case H_great:
-    return ">";
-  case H_less:
-    return "<";
-  case H_greatEqual:
-    return ">=";
-  case H_lessEqual:
-    return "<=";
-  case H_sin:
-    return "sin";
-  case H_cos:
-    return "cos";
-  case H_tan:
-    return "tan";
-  case H_sec:
-    return "sec";
-  case H_cosec:
-    return "cosec";
-  case H_cot:
-    return "cot";
-  case H_asin:
-    return "asin";
-  case H_acos:
-    return "acos";
-  case H_atan:
-    return "atan";
-  case H_asec:
-    return "asec";
-  case H_acosec:
-    return "acosec";
-  case H_acot:
-    return "acot";
-  case H_sinh:
-    return "sinh";
-  case H_cosh:
-    return "cosh";
-  case H_tanh:
-    return "tanh";
-  case H_log:
-    return "log";
-  case H_ln:
-    return "ln";
-  case H_logten:
-    return "logten";
-  case H_abs:
-    return "abs";
-  case H_floor:
-    return "floor";
-  case H_ceil:
-    return "ceil";
-  case 0:
+  if (not this->op)
     return "(null)";
-  default:
-    return "";
-  }
-}
-
-void makeOperatorHashes() {
-  int i = 0, j;
-  optr_hash t;
-
-  /* Generating */
-  for (; i < 22; ++i) {
-    binOpsHash[i] = generateHashKey(bin_ops[i]) % unify;
-    unOpsHash[i] = generateHashKey(un_ops[i]) % unify;
-  }
-
-  /* Sorting */
-  for (i = 0; i < 22; ++i)
-    for (j = 0; j < 22 - i - 1; ++j)
-      if (unOpsHash[j] > unOpsHash[j + 1]) {
-        t = unOpsHash[j];
-        unOpsHash[j] = unOpsHash[j + 1];
-        unOpsHash[j + 1] = t;
-      }
-  for (i = 0; i < 21; ++i)
-    for (j = 0; j < 21 - i - 1; ++j)
-      if (binOpsHash[j] > binOpsHash[j + 1]) {
-        t = binOpsHash[j];
-        binOpsHash[j] = binOpsHash[j + 1];
-        binOpsHash[j + 1] = t;
-      }
+  return this->opCode < C_count ? optrs[this->opCode].name : "";
 }
 
 #define HIGH 20
@@ -372,8 +282,9 @@ uint8_t Operator::checkPriority(const Operator s2) const {
 }
 
 bool Operator::setFromString(constStr x) {
-  this->op = generateHashKey(x, 0, 0);
-  return this->setOperatorProperties();
+  this->op = generateHashKey(x);
+  return this->setOperatorProperties() &&
+         not strcmp(optrs[this->opCode].name, x);
 }
 
 bool Operator::isBracket() {
@@ -8,7 +8,10 @@
 typedef ulong str_hash;
 typedef uint optr_hash;
 
-extern void makeOperatorHashes();
+// The operator tables are generated at compile time. This is kept for older
+// callers and does nothing.
+[[deprecated("operator tables no longer need initialization")]]
+inline void makeOperatorHashes() {}
 extern double factorial(double x);
 
 class Operator {
@@ -61,8 +64,60 @@ public:
     H_ceil = 204432389
   };
 
+  // Dense operator codes. Binary operators come first so that the arity of a
+  // code can be checked with a single comparison.
+  enum optrCode : uint8_t {
+    C_plus,
+    C_minus,
+    C_multiply,
+    C_divide,
+    C_pow,
+    C_mod,
+    C_P,
+    C_C,
+    C_bitAnd,
+    C_bitOr,
+    C_bitShiftRight,
+    C_bitShiftLeft,
+    C_and,
+    C_or,
+    C_great,
+    C_less,
+    C_greatEqual,
+    C_lessEqual,
+    C_equal,
+    C_notEqual,
+    C_log,
+    C_bitNot,
+    C_not,
+    C_sin,
+    C_cos,
+    C_tan,
+    C_sec,
+    C_cosec,
+    C_cot,
+    C_asin,
+    C_acos,
+    C_atan,
+    C_asec,
+    C_acosec,
+    C_acot,
+    C_sinh,
+    C_cosh,
+    C_tanh,
+    C_ln,
+    C_logten,
+    C_abs,
+    C_floor,
+    C_ceil,
+    C_openBracket,
+    C_closeBracket,
+    C_count
+  };
+
 private:
   optr_hash op;
+  optrCode opCode;
   bool isBinary;
   uint8_t priority;
   bool setOperatorProperties();
@@ -70,12 +125,15 @@ private:
 public:
   Operator();
   explicit Operator(optr_hash);
+  explicit Operator(optrCode);
   explicit Operator(constStr);
   Operator(const Operator &);
   bool isUnary() const;
+  optrCode code() const;
   constStr toString() const;
   uint8_t checkPriority(const Operator) const;
   uint8_t parse(constStr &);
+  uint8_t parse(constStr &, constStr);
   bool setFromString(constStr);
   bool isBracket();
   void operator=(const Operator &);
@@ -100,245 +158,414 @@ public:
 
 #define PI 3.14
 
-extern unsigned char angle_type;
+template <typename numT> class calcProgram;
+
+// Apply the operator on its operands. For unary operators only y is used.
+// Angles of trigonometric functions are in angle, which is RAD, DEG or GRAD.
+template <typename numType>
+ERROR operate(const Operator &, const numType, const numType, numType &,
+              const uint8_t angle = DEG);
+// Same as above but throws the error
+template <typename numType>
+numType operate(const Operator &, const numType, const numType,
+                const uint8_t angle = DEG);
 
+// Errors are returned instead of being thrown
 template <typename numType> class operatorManager {
   calcStack<Operator> operatorStack;
   calcStack<numType> numberStack;
+  // If set, operators and numbers are emitted into the program instead of
+  // being calculated
+  calcProgram<numType> *program;
+  // Angle unit of the trigonometric functions
+  uint8_t angle;
   // Calculates the ans and puts it into the numberStack
   template <typename num> friend class calcParse;
-  void calculate(const Operator &);
+  ERROR calculate(const Operator &);
 
 public:
+  operatorManager() : program(NULL), angle(DEG) {}
+
   // Insert a given Operator into the operatorStack. Uses calculate().
-  void insertOptr(const Operator);
+  ERROR insertOptr(const Operator);
   // Insert a given Operator given the optrHash
-  void insertOptr(const Operator::optrHash oh) {
+  ERROR insertOptr(const Operator::optrHash oh) {
     Operator top(oh);
-    this->insertOptr(top);
+    return this->insertOptr(top);
   }
   // Push a number into the numberStack
-  void insertNum(const numType);
+  ERROR insertNum(const numType);
   // No more input left. Pop out and calculate everything left.
-  bool finishCalculation();
+  ERROR finishCalculation();
   // Pop out the last number in the numberStack
-  bool ans(numType &);
+  ERROR ans(numType &);
+  // RAD, DEG or GRAD
+  void setAngle(const uint8_t a) { this->angle = a; }
+  // Empty the stacks keeping their memory
+  void reset() {
+    this->operatorStack.reset();
+    this->numberStack.reset();
+    this->program = NULL;
+  }
 
   template <typename numT> friend class calcParse;
 };
 
 template <typename numType>
-void operatorManager<numType>::insertOptr(const Operator z) {
+ERROR operatorManager<numType>::insertOptr(const Operator z) {
   Operator top;
 
   while (this->operatorStack.get(top) and top < z) {
-    this->operatorStack.pop(); // We have the operator in top
-    this->calculate(top);      // Calculate the result
+    this->operatorStack.pop();    // We have the operator in top
+    CALC_TRY(this->calculate(top));  // Calculate the result
   }
 
-  this->operatorStack.push(z);
+  if (not this->operatorStack.push(z))
+    CALC_FAIL(memAlloc);
+  return ERROR();
 }
 
 template <typename numType>
-void operatorManager<numType>::insertNum(const numType x) {
-  this->numberStack.push(x);
+ERROR operatorManager<numType>::insertNum(const numType x) {
+  if (this->program)
+    this->program->emitNum(x);
+  else if (not this->numberStack.push(x))
+    CALC_FAIL(memAlloc);
+  return ERROR();
 }
 
-template <typename numType> bool operatorManager<numType>::finishCalculation() {
+template <typename numType> ERROR operatorManager<numType>::finishCalculation() {
   Operator top;
 
   while (this->operatorStack.pop(top)) {
     if (top != Operator::H_openBracket)
-      this->calculate(top);
+      CALC_TRY(this->calculate(top));
   }
 
   if (this->operatorStack.isEmpty())
-    return 1;
-  error(numScarce);
+    return ERROR();
+  CALC_FAIL(numScarce);
 }
 
-template <typename numType> bool operatorManager<numType>::ans(numType &x) {
+template <typename numType> ERROR operatorManager<numType>::ans(numType &x) {
 #ifdef TESTING
   if (not this->operatorStack.isEmpty())
     throw "Operators left in stack due to some error";
 #endif
+  if (this->program) {
+    // Only the depth is known while compiling
+    if (this->program->depth == 1)
+      return ERROR();
+    CALC_FAIL(numScarce);
+  }
   if (this->numberStack.pop(x) && this->numberStack.isEmpty())
-    return 1;
-  error(numScarce);
+    return ERROR();
+  CALC_FAIL(numScarce);
 }
 
 template <typename numType>
-void operatorManager<numType>::calculate(const Operator &top) {
-  numType x = 0, y = 0;
+ERROR operatorManager<numType>::calculate(const Operator &top) {
+  if (this->program)
+    return this->program->emitOptr(top);
+
+  numType x = 0, y = 0, z;
   if (not this->numberStack.pop(y))
-    error(numScarce);
+    CALC_FAIL(numScarce);
   if (not top.isUnary() && not this->numberStack.pop(x))
     // The second number iff top is a binary operator
-    error(numScarce);
+    CALC_FAIL(numScarce);
 
-  numType z = angle_type == DEG ? (y * PI / 180)
-                                : (angle_type == RAD ? y : (y * PI / 200)),
-          ans;
+  CALC_TRY(operate(top, x, y, z, this->angle));
+  if (not this->numberStack.push(z))
+    CALC_FAIL(memAlloc);
+  return ERROR();
+}
+
+// Angle conversions done by operate() around the trigonometric handlers
+template <typename numType>
+inline numType toRadian(const numType y, const uint8_t angle) {
+  return angle == DEG ? (y * PI / 180) : (angle == RAD ? y : (y * PI / 200));
+}
+
+template <typename numType>
+inline numType fromRadian(const numType y, const uint8_t angle) {
+  return angle == DEG ? (y * 180 / PI) : (angle == GRAD ? (y * 200 / PI) : y);
+}
+
+// Calculation of every operator. table is indexed by Operator::optrCode, so
+// reaching an operator costs the same irrespective of which one it is.
+// Trigonometric handlers work in radians.
+template <typename numType> struct optrHandler {
+  typedef ERROR (*function)(const numType, const numType, numType &);
+  static const function table[Operator::C_count + 1];
 
   /* Basic arithmatic operators */
-  if (top == Operator::H_plus)
-    ans = x + y;
-  else if (top == Operator::H_minus)
-    ans = x - y;
-  else if (top == Operator::H_multiply)
-    ans = x * y;
-  else if (top == Operator::H_divide) {
-    if (y)
-      ans = x / y;
-    else
-      error(divError);
-  } else if (top == Operator::H_pow)
-    ans = powl(x, y);
+  static ERROR plus(const numType x, const numType y, numType &z) {
+    z = x + y;
+    return ERROR();
+  }
+  static ERROR minus(const numType x, const numType y, numType &z) {
+    z = x - y;
+    return ERROR();
+  }
+  static ERROR multiply(const numType x, const numType y, numType &z) {
+    z = x * y;
+    return ERROR();
+  }
+  static ERROR divide(const numType x, const numType y, numType &z) {
+    if (not y)
+      CALC_FAIL(divError);
+    z = x / y;
+    return ERROR();
+  }
+  static ERROR pow(const numType x, const numType y, numType &z) {
+    z = powl(x, y);
+    return ERROR();
+  }
 
   /* Factorials */
-  else if (top == Operator::H_P) {
-    if (x >= 0 && y >= 0 && x >= y && !(x - floorl(x)) && !(y - floorl(y)))
-      ans = factorial(x) / factorial(x - y);
-    else
-      error(factError);
-  } else if (top == Operator::H_C) {
-    if (x >= 0 && y >= 0 && x >= y && !(x - floorl(x)) && !(y - floorl(y)))
-      ans = factorial(x) / (factorial(y) * factorial(x - y));
-    else
-      error(factError);
+  static bool isFactorable(const numType x, const numType y) {
+    return x >= 0 && y >= 0 && x >= y && !(x - floorl(x)) && !(y - floorl(y));
+  }
+  static ERROR P(const numType x, const numType y, numType &z) {
+    if (not isFactorable(x, y))
+      CALC_FAIL(factError);
+    z = factorial(x) / factorial(x - y);
+    return ERROR();
+  }
+  static ERROR C(const numType x, const numType y, numType &z) {
+    if (not isFactorable(x, y))
+      CALC_FAIL(factError);
+    z = factorial(x) / (factorial(y) * factorial(x - y));
+    return ERROR();
   }
 
   /* Computer related basic operators */
-  else if (top == Operator::H_bitNot)
-    ans = ~(ulong)y;
-  else if (top == Operator::H_bitOr)
-    ans = (ulong)x | (ulong)y;
-  else if (top == Operator::H_bitAnd)
-    ans = (ulong)x & (ulong)y;
-  else if (top == Operator::H_mod)
-    ans = fmodl(x, y);
-  else if (top == Operator::H_bitShiftRight)
-    ans = (ulong)x >> (ulong)y;
-  else if (top == Operator::H_bitShiftLeft)
-    ans = (ulong)x << (ulong)y;
+  static ERROR bitNot(const numType, const numType y, numType &z) {
+    z = ~(ulong)y;
+    return ERROR();
+  }
+  static ERROR bitOr(const numType x, const numType y, numType &z) {
+    z = (ulong)x | (ulong)y;
+    return ERROR();
+  }
+  static ERROR bitAnd(const numType x, const numType y, numType &z) {
+    z = (ulong)x & (ulong)y;
+    return ERROR();
+  }
+  static ERROR mod(const numType x, const numType y, numType &z) {
+    z = fmodl(x, y);
+    return ERROR();
+  }
+  static ERROR bitShiftRight(const numType x, const numType y, numType &z) {
+    z = (ulong)x >> (ulong)y;
+    return ERROR();
+  }
+  static ERROR bitShiftLeft(const numType x, const numType y, numType &z) {
+    z = (ulong)x << (ulong)y;
+    return ERROR();
+  }
 
   /* Relational operators */
-  else if (top == Operator::H_great)
-    ans = x > y;
-  else if (top == Operator::H_less)
-    ans = x < y;
-  else if (top == Operator::H_greatEqual)
-    ans = x >= y;
-  else if (top == Operator::H_lessEqual)
-    ans = x <= y;
-  else if (top == Operator::H_notEqual)
-    ans = x != y;
-  else if (top == Operator::H_equal)
-    ans = x == y;
+  static ERROR great(const numType x, const numType y, numType &z) {
+    z = x > y;
+    return ERROR();
+  }
+  static ERROR less(const numType x, const numType y, numType &z) {
+    z = x < y;
+    return ERROR();
+  }
+  static ERROR greatEqual(const numType x, const numType y, numType &z) {
+    z = x >= y;
+    return ERROR();
+  }
+  static ERROR lessEqual(const numType x, const numType y, numType &z) {
+    z = x <= y;
+    return ERROR();
+  }
+  static ERROR notEqual(const numType x, const numType y, numType &z) {
+    z = x != y;
+    return ERROR();
+  }
+  static ERROR equal(const numType x, const numType y, numType &z) {
+    z = x == y;
+    return ERROR();
+  }
 
   /* Other mathematical functions */
-  else if (top == Operator::H_log) {
-    if (y > 0 && x >= 0)
-      ans = logl(y) / logl(x);
-    else
-      error(rangUndef);
-  } else if (top == Operator::H_abs)
-    ans = fabsl(y);
-  else if (top == Operator::H_ceil)
-    ans = ceill(y);
-  else if (top == Operator::H_floor)
-    ans = floorl(y);
-  else if (top == Operator::H_ln) {
-    if (y > 0)
-      ans = logl(y);
-    else
-      error(rangUndef);
-  } else if (top == Operator::H_logten) {
-    if (y > 0)
-      ans = log10l(y);
-    else
-      error(rangUndef);
-  } else if (top == Operator::H_sinh)
-    ans = sinhl(z);
-  else if (top == Operator::H_cosh)
-    ans = coshl(z);
-  else if (top == Operator::H_tanh)
-    ans = tanhl(z);
-  else if (top == Operator::H_sin)
-    ans = sinl(z);
-  else if (top == Operator::H_cos)
-    ans = cosl(z);
-  else if (top == Operator::H_tan) {
-    if (cosl(z))
-      ans = tanl(z);
-    else
-      error(rangUndef);
-  } else if (top == Operator::H_cosec) {
-    if (sinl(z))
-      ans = 1 / sinl(z);
-    else
-      error(rangUndef);
-  } else if (top == Operator::H_sec) {
-    if (cosl(z))
-      ans = 1 / cosl(z);
-    else
-      error(rangUndef);
-  } else if (top == Operator::H_cot) {
-    if (sinl(z))
-      ans = 1 / tanl(z);
-    else
-      error(rangUndef);
-  } else if (top == Operator::H_asin) {
-    if (y <= 1 && y >= -1)
-      ans = angle_type == DEG
-                ? (asinl(y) * 180 / PI)
-                : angle_type == GRAD ? (asinl(y) * 200 / PI) : (asinl(y));
-    else
-      error(domUndef);
-  } else if (top == Operator::H_acos) {
-    if (y <= 1.0 && y >= -1.0)
-      ans = angle_type == DEG
-                ? (acosl(y) * 180 / PI)
-                : angle_type == GRAD ? (acosl(y) * 200 / PI) : (acosl(y));
-    else
-      error(domUndef);
-  } else if (top == Operator::H_atan)
-    ans = angle_type == DEG
-              ? (atanl(y) * 180 / PI)
-              : angle_type == GRAD ? (atanl(y) * 200 / PI) : (atanl(y));
-  else if (top == Operator::H_acosec) {
-    if (y <= -1.0 || y >= 1.0)
-      ans = angle_type == DEG ? (asinl(1 / y) * 180 / PI)
-                              : angle_type == GRAD ? (asinl(1 / y) * 200 / PI)
-                                                   : (asinl(1 / y));
-    else
-      error(domUndef);
-  } else if (top == Operator::H_asec) {
-    if (y <= -1 || y >= 1)
-      ans = angle_type == DEG ? (acosl(1 / y) * 180 / PI)
-                              : angle_type == GRAD ? (acosl(1 / y) * 200 / PI)
-                                                   : (acosl(1 / y));
-    else
-      error(domUndef);
-  } else if (top == Operator::H_acot)
-    ans = angle_type == DEG
-              ? (atanl(1 / y) * 180 / PI)
-              : angle_type == GRAD ? (atanl(1 / y) * 200 / PI) : (atanl(1 / y));
+  static ERROR log(const numType x, const numType y, numType &z) {
+    if (not (y > 0 && x >= 0))
+      CALC_FAIL(rangUndef);
+    z = logl(y) / logl(x);
+    return ERROR();
+  }
+  static ERROR abs(const numType, const numType y, numType &z) {
+    z = fabsl(y);
+    return ERROR();
+  }
+  static ERROR ceil(const numType, const numType y, numType &z) {
+    z = ceill(y);
+    return ERROR();
+  }
+  static ERROR floor(const numType, const numType y, numType &z) {
+    z = floorl(y);
+    return ERROR();
+  }
+  static ERROR ln(const numType, const numType y, numType &z) {
+    if (not (y > 0))
+      CALC_FAIL(rangUndef);
+    z = logl(y);
+    return ERROR();
+  }
+  static ERROR logten(const numType, const numType y, numType &z) {
+    if (not (y > 0))
+      CALC_FAIL(rangUndef);
+    z = log10l(y);
+    return ERROR();
+  }
+  static ERROR sinh(const numType, const numType y, numType &z) {
+    z = sinhl(y);
+    return ERROR();
+  }
+  static ERROR cosh(const numType, const numType y, numType &z) {
+    z = coshl(y);
+    return ERROR();
+  }
+  static ERROR tanh(const numType, const numType y, numType &z) {
+    z = tanhl(y);
+    return ERROR();
+  }
+  static ERROR sin(const numType, const numType y, numType &z) {
+    z = sinl(y);
+    return ERROR();
+  }
+  static ERROR cos(const numType, const numType y, numType &z) {
+    z = cosl(y);
+    return ERROR();
+  }
+  static ERROR tan(const numType, const numType y, numType &z) {
+    if (not cosl(y))
+      CALC_FAIL(rangUndef);
+    z = tanl(y);
+    return ERROR();
+  }
+  static ERROR cosec(const numType, const numType y, numType &z) {
+    if (not sinl(y))
+      CALC_FAIL(rangUndef);
+    z = 1 / sinl(y);
+    return ERROR();
+  }
+  static ERROR sec(const numType, const numType y, numType &z) {
+    if (not cosl(y))
+      CALC_FAIL(rangUndef);
+    z = 1 / cosl(y);
+    return ERROR();
+  }
+  static ERROR cot(const numType, const numType y, numType &z) {
+    if (not sinl(y))
+      CALC_FAIL(rangUndef);
+    z = 1 / tanl(y);
+    return ERROR();
+  }
+  static ERROR asin(const numType, const numType y, numType &z) {
+    if (not (y <= 1 && y >= -1))
+      CALC_FAIL(domUndef);
+    z = asinl(y);
+    return ERROR();
+  }
+  static ERROR acos(const numType, const numType y, numType &z) {
+    if (not (y <= 1 && y >= -1))
+      CALC_FAIL(domUndef);
+    z = acosl(y);
+    return ERROR();
+  }
+  static ERROR atan(const numType, const numType y, numType &z) {
+    z = atanl(y);
+    return ERROR();
+  }
+  static ERROR acosec(const numType, const numType y, numType &z) {
+    if (not (y <= -1 || y >= 1))
+      CALC_FAIL(domUndef);
+    z = asinl(1 / y);
+    return ERROR();
+  }
+  static ERROR asec(const numType, const numType y, numType &z) {
+    if (not (y <= -1 || y >= 1))
+      CALC_FAIL(domUndef);
+    z = acosl(1 / y);
+    return ERROR();
+  }
+  static ERROR acot(const numType, const numType y, numType &z) {
+    z = atanl(1 / y);
+    return ERROR();
+  }
 
   /* Logical operators */
-  else if ((x == 1 || x == 0) && (y == 1 || y == 0)) {
-    if (top == Operator::H_not)
-      ans = !y;
-    else if (top == Operator::H_or)
-      ans = x || y;
-    else if (top == Operator::H_and)
-      ans = x && y;
-    else
-      error(invalidOptr);
-  } else
-    error(invalidOptr);
-
-  this->numberStack.push(ans);
+  static bool isLogical(const numType x, const numType y) {
+    return (x == 1 || x == 0) && (y == 1 || y == 0);
+  }
+  static ERROR logicalNot(const numType x, const numType y, numType &z) {
+    if (not isLogical(x, y))
+      CALC_FAIL(invalidOptr);
+    z = !y;
+    return ERROR();
+  }
+  static ERROR logicalAnd(const numType x, const numType y, numType &z) {
+    if (not isLogical(x, y))
+      CALC_FAIL(invalidOptr);
+    z = x && y;
+    return ERROR();
+  }
+  static ERROR logicalOr(const numType x, const numType y, numType &z) {
+    if (not isLogical(x, y))
+      CALC_FAIL(invalidOptr);
+    z = x || y;
+    return ERROR();
+  }
+
+  // Brackets and unknown operators
+  static ERROR invalid(const numType, const numType, numType &) {
+    CALC_FAIL(invalidOptr);
+  }
+};
+
+template <typename numType>
+const typename optrHandler<numType>::function
+    optrHandler<numType>::table[Operator::C_count + 1] = {
+        plus,       minus,     multiply,      divide,       pow,
+        mod,        P,         C,             bitAnd,       bitOr,
+        bitShiftRight,         bitShiftLeft,  logicalAnd,   logicalOr,
+        great,      less,      greatEqual,    lessEqual,    equal,
+        notEqual,   log,       bitNot,        logicalNot,   sin,
+        cos,        tan,       sec,           cosec,        cot,
+        asin,       acos,      atan,          asec,         acosec,
+        acot,       sinh,      cosh,          tanh,         ln,
+        logten,     abs,       floor,         ceil,         invalid,
+        invalid,    invalid
+};
+
+template <typename numType>
+ERROR operate(const Operator &top, const numType x, const numType y,
+              numType &z, const uint8_t angle) {
+  const Operator::optrCode c = top.code();
+  // sin to cot, asin to acot and sinh to tanh follow each other
+  if (angle == RAD || c < Operator::C_sin || c > Operator::C_tanh)
+    return optrHandler<numType>::table[c](x, y, z);
+  if (c < Operator::C_asin || c > Operator::C_acot)
+    return optrHandler<numType>::table[c](x, toRadian(y, angle), z);
+  CALC_TRY(optrHandler<numType>::table[c](x, y, z));
+  z = fromRadian(z, angle);
+  return ERROR();
+}
+
+template <typename numType>
+numType operate(const Operator &top, const numType x, const numType y,
+                const uint8_t angle) {
+  numType z;
+  const ERROR e = operate(top, x, y, z, angle);
+  if (e.isSet())
+    throw new ERROR(e);
+  return z;
 }
 
 #endif
@@ -2,17 +2,26 @@
 #define CALC_PARSER_H
 
 #include "answerManager.hpp"
+#include "calcAST.hpp"
+#include "calcContext.hpp"
 #include "calcOptr.hpp"
+#include "calcProgram.hpp"
 #include "common.hpp"
 #include "str.hpp"
 
+// The parser reads the caller's buffer in place. It is never copied, so it has
+// to outlive the parser. Parsing stops at the end of the buffer, at a NUL or at
+// the terminating character given to the constructor.
 template <typename numT> class calcParse {
   constStr input;
+  constStr inputEnd;
   constStr currentPos;
   numT ans;
   char end;
   bool running;
   bool over;
+  bool comment;
+  ulong errorPos;
   using prevTokenType = enum {
     ClearField,
     Number,
@@ -22,178 +31,303 @@ template <typename numT> class calcParse {
     CloseBracket
   };
   prevTokenType prevToken;
-  operatorManager<numT> optr;
-
-  void gotOpenBracket();
-  void gotCloseBracket();
-  void gotPlusMinus();
-  void gotChar();
-  void gotNum();
-  void gotOptr(const Operator &);
-  void gotAns();
-  bool gotVar();
+  // Stacks of the parser unless a context's are used
+  operatorManager<numT> ownOptr;
+  operatorManager<numT> &optr;
+  // Arena and answers of the context if there is one
+  calcArena *arena;
+  answerManager<numT> *answers;
+
+  // Errors are returned instead of being thrown
+  ERROR gotOpenBracket();
+  ERROR gotCloseBracket();
+  ERROR gotPlusMinus();
+  ERROR gotChar();
+  ERROR gotNum();
+  ERROR gotOptr(const Operator &);
+  ERROR gotAns();
+  ERROR gotVar();
+  void skipSpaces();
+  ERROR parseTokens();
+
+  // The character i places ahead or NUL beyond the end of input
+  inline char peek(const ulong i = 0) const {
+    return (ulong)(this->inputEnd - this->currentPos) > i ? this->currentPos[i]
+                                                          : '\0';
+  }
 
-  inline bool isOpenBracket() { return *this->currentPos == '('; }
+  inline bool isOpenBracket() { return this->peek() == '('; }
 
-  inline bool isAns() {
-    return *this->currentPos == 'a' && isdigit(this->currentPos[1]);
-  }
+  inline bool isAns() { return this->peek() == 'a' && isdigit(this->peek(1)); }
 
-  inline bool isCloseBracket() { return *this->currentPos == ')'; }
+  inline bool isCloseBracket() { return this->peek() == ')'; }
 
-  inline bool isPlus() { return *this->currentPos == '+'; }
+  inline bool isPlus() { return this->peek() == '+'; }
 
-  inline bool isMinus() { return *this->currentPos == '-'; }
+  inline bool isMinus() { return this->peek() == '-'; }
 
-  inline bool isChar() { return isalpha(*this->currentPos); }
+  inline bool isChar() { return isalpha(this->peek()); }
 
   inline bool isNum() {
-    return isdigit(*this->currentPos) ||
-           (*this->currentPos == '.' && isdigit(this->currentPos[1]));
+    return isdigit(this->peek()) ||
+           (this->peek() == '.' && isdigit(this->peek(1)));
   }
 
+  calcParse(operatorManager<numT> *o, calcArena *a, answerManager<numT> *l,
+            constStr inp, const ulong len)
+      : input(inp), inputEnd(inp + len), currentPos(NULL), ans(0), end(0),
+        running(false), over(false), comment(false), errorPos(0),
+        prevToken(ClearField), optr(o ? *o : ownOptr), arena(a), answers(l),
+        storeAnswers(true) {}
+
 public:
   bool storeAnswers;
 
-  explicit calcParse(constStr inp)
-      : currentPos(NULL), ans(0), end(0), running(false),
-        over(false), prevToken(ClearField), storeAnswers(true) {
-    input = trimSpaces(inp);
-  }
-  calcParse(constStr inp, char e)
-      : currentPos(NULL), ans(0), end(e), running(false),
-        over(false), prevToken(ClearField), storeAnswers(true) {
-    input = trimSpaces(inp);
+  // Parse len characters from inp. inp needn't be NUL terminated. Without a
+  // context there are no answers and angles are in degrees.
+  calcParse(constStr inp, const ulong len)
+      : calcParse(NULL, NULL, NULL, inp, len) {}
+  // Same as above with the answers, angle unit and memory of the context
+  calcParse(calcContext<numT> &c, constStr inp, const ulong len)
+      : calcParse(&c.optr, &c.arena, &c.answers, inp, len) {
+    c.begin();
   }
-  calcParse(str inp, str start)
-      : currentPos(start), ans(0), end(0), running(false),
-        over(false), prevToken(ClearField), storeAnswers(true) {
-    input = trimSpaces(inp);
+  calcParse(const calcParse &) = delete;
+  explicit calcParse(constStr inp) : calcParse(inp, strlen(inp)) {}
+  calcParse(constStr inp, char e) : calcParse(inp, strlen(inp)) { end = e; }
+  calcParse(str inp, str start) : calcParse(inp, strlen(inp)) {
+    currentPos = start;
   }
-  calcParse(constStr inp, str start, char e)
-      : currentPos(start), ans(0), end(e), running(false),
-        over(false), prevToken(ClearField), storeAnswers(true) {
-    input = trimSpaces(inp);
-  }
-  ~calcParse() {
-    delete input;
+  calcParse(constStr inp, str start, char e) : calcParse(inp, strlen(inp)) {
+    currentPos = start;
+    end = e;
   }
   bool isParsing() { return running; }
   bool isOver() { return over; }
+  // False if the input was only a comment
+  bool hasAns() { return over && not comment; }
+  // Offset in the input of the token where the last error was found
+  ulong errorPosition() { return errorPos; }
+  // Parse and calculate. The error is returned instead of being thrown.
+  ERROR tryParsing();
   void startParsing();
+  // Parse the input into a program which can be run repeatedly. Names which
+  // aren't operators become variables of the program. Unless told otherwise
+  // the program is simplified by calcAST. The error is returned instead of
+  // being thrown.
+  ERROR tryCompiling(calcProgram<numT> &, bool optimize = true);
+  void compile(calcProgram<numT> &, bool optimize = true);
   numT Ans() { return ans; }
   template <typename T>
   friend std::ostream& operator<<(std::ostream&, calcParse<T>&);
 };
 
-template <typename numT> void calcParse<numT>::gotOpenBracket() {
+template <typename numT> ERROR calcParse<numT>::gotOpenBracket() {
   if (this->prevToken == Number)
-    this->optr.insertOptr(Operator::H_multiply);
+    CALC_TRY(this->optr.insertOptr(Operator::H_multiply));
   this->prevToken = OpenBracket;
   ++this->currentPos;
   Operator op(Operator::H_openBracket);
-  this->optr.operatorStack.push(op);
+  if (not this->optr.operatorStack.push(op))
+    CALC_FAIL(memAlloc);
+  return ERROR();
 }
 
-template <typename numT> void calcParse<numT>::gotCloseBracket() {
+template <typename numT> ERROR calcParse<numT>::gotCloseBracket() {
   this->prevToken = CloseBracket;
   ++this->currentPos;
   Operator top;
   while (optr.operatorStack.pop(top) && top != Operator::H_openBracket) {
-    optr.calculate(top);
+    CALC_TRY(optr.calculate(top));
   }
   if (top != Operator::H_openBracket)
-    error(brktError);
+    CALC_FAIL(brktError);
+  return ERROR();
 }
 
-template <typename numT> void calcParse<numT>::gotNum() {
+template <typename numT> ERROR calcParse<numT>::gotNum() {
   if (this->prevToken == CloseBracket)
-    this->optr.insertOptr(Operator::H_multiply);
+    CALC_TRY(this->optr.insertOptr(Operator::H_multiply));
   this->prevToken = Number;
   numT x = 0;
-  if (strToNum(&this->currentPos, x, REAL) == 0)
-    error(parseError);
-  optr.insertNum(x);
+  if (strToNum(&this->currentPos, this->inputEnd, x, REAL) == 0)
+    CALC_FAIL(parseError);
+  return optr.insertNum(x);
 }
 
-template <typename numT> void calcParse<numT>::gotOptr(const Operator &op) {
+template <typename numT> ERROR calcParse<numT>::gotOptr(const Operator &op) {
   this->prevToken = op.isUnary() ? UnaryOperator : BinaryOperator;
-  this->optr.insertOptr(op);
+  return this->optr.insertOptr(op);
 }
 
-template <typename numT> void calcParse<numT>::gotAns() {
+template <typename numT> ERROR calcParse<numT>::gotAns() {
   numT number;
-  answers.parseAns(this->currentPos, number);
+  ulong pos = 0;
+  CALC_TRY(answerManager<numT>::parseAnsPos(this->currentPos,
+                                            this->inputEnd, pos));
+  // While compiling the answer is looked up when the program runs
+  if (not this->optr.program) {
+    if (not this->answers)
+      CALC_FAIL(invalidAns);
+    CALC_TRY(this->answers->findAns(number, pos));
+  }
   if (this->prevToken == CloseBracket)
-    this->optr.insertOptr(Operator::H_multiply);
+    CALC_TRY(this->optr.insertOptr(Operator::H_multiply));
   this->prevToken = Number;
-  optr.insertNum(number);
+  if (not this->optr.program)
+    return optr.insertNum(number);
+  this->optr.program->emitAns(pos);
+  return ERROR();
 }
 
-template <typename numT> void calcParse<numT>::gotChar() {
+template <typename numT> ERROR calcParse<numT>::gotChar() {
   Operator op;
   if (this->isAns())
-    this->gotAns();
-  else if (op.parse(this->currentPos))
-    this->gotOptr(op);
-  else
-    error(parseError);
+    return this->gotAns();
+  // In programs a name is only an operator if all of it is one, so that cost
+  // is a variable and not cos t
+  if (this->optr.program && (isalpha(this->peek()) || this->peek() == '_')) {
+    constStr c = this->currentPos, e = c;
+    while (e < this->inputEnd && (isalpha(*e) || *e == '_'))
+      ++e;
+    if (op.parse(c, e) && c == e) {
+      this->currentPos = c;
+      return this->gotOptr(op);
+    }
+    return this->gotVar();
+  }
+  if (op.parse(this->currentPos, this->inputEnd))
+    return this->gotOptr(op);
+  if (this->optr.program)
+    return this->gotVar();
+  CALC_FAIL(parseError);
 }
 
-template <typename numT> void calcParse<numT>::gotPlusMinus() {
+template <typename numT> ERROR calcParse<numT>::gotVar() {
+  constStr c = this->currentPos;
+  while (c < this->inputEnd && (isalpha(*c) || *c == '_'))
+    ++c;
+  if (c == this->currentPos)
+    CALC_FAIL(parseError);
+  if (this->prevToken == Number or this->prevToken == CloseBracket)
+    CALC_TRY(this->optr.insertOptr(Operator::H_multiply));
+  this->prevToken = Number;
+  this->optr.program->emitVar(this->currentPos, c - this->currentPos);
+  this->currentPos = c;
+  return ERROR();
+}
+
+template <typename numT> ERROR calcParse<numT>::gotPlusMinus() {
   if (this->prevToken == Number or this->prevToken == CloseBracket) {
     this->prevToken = BinaryOperator;
-    this->optr.insertOptr(this->isPlus() ? Operator::H_plus
-                                         : Operator::H_minus);
+    CALC_TRY(this->optr.insertOptr(this->isPlus() ? Operator::H_plus
+                                                  : Operator::H_minus));
     this->currentPos++;
-  } else
-    this->gotNum();
+    return ERROR();
+  }
+  return this->gotNum();
 }
 
-template <typename numT> void calcParse<numT>::startParsing() {
-  this->running = true;
+template <typename numT> void calcParse<numT>::skipSpaces() {
+  while (this->currentPos < this->inputEnd && isspace(*this->currentPos))
+    ++this->currentPos;
+}
 
+template <typename numT> ERROR calcParse<numT>::parseTokens() {
   prevToken = ClearField;
 
 #ifdef TESTING
-  if (this->input)
+  if (not this->input)
     throw "calcParse<T>::input not set\n";
 #endif
 
   if (this->currentPos == NULL)
     this->currentPos = this->input;
 
-  if (*this->currentPos == '#')
-    error(noError);
-
-  while (*this->currentPos && *this->currentPos != end) {
+  this->skipSpaces();
+  if (this->peek() == '#') {
+    this->comment = true;
+    return ERROR();
+  }
 
-    skipSpace(this->currentPos);
+  while (this->peek() && this->peek() != end) {
 
-    if (*this->currentPos == '#') {
+    if (this->peek() == '#') {
       break;
     }
 
+    this->errorPos = this->currentPos - this->input;
     if (this->isOpenBracket()) {
-      this->gotOpenBracket();
+      CALC_TRY(this->gotOpenBracket());
     } else if (this->isCloseBracket()) {
-      this->gotCloseBracket();
+      CALC_TRY(this->gotCloseBracket());
     } else if (this->isNum()) {
-      this->gotNum();
+      CALC_TRY(this->gotNum());
     } else if (this->isPlus() or this->isMinus()) {
-      this->gotPlusMinus();
+      CALC_TRY(this->gotPlusMinus());
     } else
-      this->gotChar();
+      CALC_TRY(this->gotChar());
+
+    this->skipSpaces();
   }
 
-  optr.finishCalculation();
+  this->errorPos = this->currentPos - this->input;
+  return optr.finishCalculation();
+}
+
+template <typename numT> ERROR calcParse<numT>::tryParsing() {
+  this->running = true;
 
-  if (optr.ans(this->ans) && this->storeAnswers == true) {
-    answers.push(this->ans);
+  ERROR e = this->parseTokens();
+  if (not e.isSet() && not this->comment)
+    e = optr.ans(this->ans);
+  if (not e.isSet() && not this->comment && this->storeAnswers == true &&
+      this->answers)
+    e = this->answers->tryPush(this->ans);
+
+  this->running = false;
+  this->over = true;
+  return e;
+}
+
+template <typename numT> void calcParse<numT>::startParsing() {
+  const ERROR e = this->tryParsing();
+  // Comments are reported as an ERROR::noError
+  if (e.isSet() || this->comment)
+    throw new ERROR(e);
+}
+
+template <typename numT>
+ERROR calcParse<numT>::tryCompiling(calcProgram<numT> &program,
+                                   bool optimize) {
+  this->running = true;
+
+  program.reset();
+  program.angle = this->optr.angle;
+  this->optr.program = &program;
+  ERROR e = this->parseTokens();
+  if (not e.isSet() && not this->comment)
+    e = optr.ans(this->ans);
+  this->optr.program = NULL;
+
+  if (not e.isSet() && not this->comment && optimize) {
+    calcAST<numT> ast(program, this->arena);
+    if (ast.isEmpty())
+      e = ERROR(ERROR::numScarce);
+    else
+      ast.emit(program);
   }
 
   this->running = false;
   this->over = true;
+  return e;
+}
+
+template <typename numT>
+void calcParse<numT>::compile(calcProgram<numT> &program, bool optimize) {
+  const ERROR e = this->tryCompiling(program, optimize);
+  if (e.isSet() || this->comment)
+    throw new ERROR(e);
 }
 
 #endif
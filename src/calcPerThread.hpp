@@ -0,0 +1,90 @@
+#ifndef CALC_PER_THREAD_H
+#define CALC_PER_THREAD_H
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "common.hpp"
+
+// A T for every thread using it, so that each writes to memory of its own
+// and a reader sums them up with each(). A thread takes one on its first
+// mine() and gives it back when it ends, for a later thread to go on with.
+// It holds one of every calcPerThread it uses, even of the same T. They are
+// kept as long as the calcPerThread or the thread holding one.
+template <typename T> class calcPerThread {
+  struct slot {
+    std::atomic<bool> used{true};
+    uint id = 0;
+    T value;
+  };
+  // What a thread took, one slot of every calcPerThread it used. They are
+  // known by serial rather than by address, which a later one may get.
+  struct holder {
+    std::vector<std::pair<ulong, std::shared_ptr<slot>>> taken;
+    ~holder() {
+      for (auto &t : this->taken)
+        t.second->used.store(false, std::memory_order_release);
+    }
+  };
+
+  std::mutex lock;
+  std::vector<std::shared_ptr<slot>> slots;
+  const ulong serial;
+
+  slot &take();
+  static ulong next() {
+    static std::atomic<ulong> serials{0};
+    return ++serials;
+  }
+
+public:
+  calcPerThread() : serial(next()) {}
+  calcPerThread(const calcPerThread &) = delete;
+  calcPerThread &operator=(const calcPerThread &) = delete;
+
+  T &mine() { return this->take().value; }
+  // f(value, id) for every T there is, taken by a thread or not. ids start
+  // at 1 and stay with their T.
+  template <typename F> void each(F f) {
+    std::lock_guard<std::mutex> l(this->lock);
+    for (auto &s : this->slots)
+      f(s->value, s->id);
+  }
+};
+
+template <typename T>
+typename calcPerThread<T>::slot &calcPerThread<T>::take() {
+  static thread_local holder h;
+  for (auto &t : h.taken)
+    if (t.first == this->serial)
+      return *t.second;
+  std::shared_ptr<slot> mine;
+  std::lock_guard<std::mutex> l(this->lock);
+  for (auto &s : this->slots) {
+    bool unused = false;
+    if (s->used.compare_exchange_strong(unused, true)) {
+      mine = s;
+      break;
+    }
+  }
+  if (mine == NULL) {
+    mine = std::make_shared<slot>();
+    mine->id = this->slots.size() + 1;
+    this->slots.push_back(mine);
+  }
+  h.taken.emplace_back(this->serial, mine);
+  return *mine;
+}
+
+#endif
+
+/*
+  Local Variables:
+  mode: c++
+  c-file-offset: 2
+  fill-column: 80
+  End:
+*/
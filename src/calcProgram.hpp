@@ -0,0 +1,223 @@
+#ifndef CALC_PROGRAM_H
+#define CALC_PROGRAM_H
+
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "answerManager.hpp"
+#include "calcOptr.hpp"
+
+template <typename numT> class calcAST;
+
+// A compiled expression. The parser emits numbers, answer references,
+// variables and operators in postfix order. run() evaluates them as many times
+// as needed without going through the text again.
+template <typename numT> class calcProgram {
+public:
+  enum instrType : uint8_t {
+    // Operators are stored as their Operator::optrCode
+    I_num = Operator::C_count,
+    I_ans,
+    I_var,
+    // Copy the top of the stack into a temporary
+    I_store,
+    // Push a temporary
+    I_load
+  };
+
+  struct instr {
+    uint8_t type;
+    // Index into numbers, vars or temps. Answer number for I_ans.
+    ulong arg;
+  };
+
+private:
+  std::vector<instr> code;
+  std::vector<numT> numbers;
+  // Names of the variables and their bound values
+  std::vector<std::string> vars;
+  std::vector<numT> values;
+  std::vector<bool> bound;
+  // Values shared between common subexpressions
+  std::vector<numT> temps;
+  // Evaluation stack reused by every run()
+  calcStack<numT> stack;
+  // Number of values on the stack after the last emitted instruction
+  ulong depth;
+  // Angle unit it was compiled with
+  uint8_t angle;
+
+  template <typename num> friend class operatorManager;
+  template <typename num> friend class calcParse;
+  template <typename num> friend class calcAST;
+
+  void emitNum(const numT);
+  void emitAns(const ulong);
+  void emitVar(constStr, const ulong);
+  ERROR emitOptr(const Operator &);
+
+public:
+  calcProgram() : depth(0), angle(DEG) {}
+  // Number of instructions in the program
+  ulong size() const { return code.size(); }
+  bool isEmpty() const { return code.empty(); }
+  ulong varCount() const { return vars.size(); }
+  constStr varName(const ulong i) const { return vars[i].c_str(); }
+  // Index of the named variable or -1 if the program doesn't use it
+  slong varIndex(constStr) const;
+  slong varIndex(constStr, const ulong) const;
+  // Bind a value to a variable. Returns false for unknown names.
+  bool setVar(constStr, const numT);
+  void setVar(const ulong, const numT);
+  void reset();
+  // Evaluate the program looking up answer references in answers. The error
+  // is returned instead of being thrown.
+  ERROR run(numT &, answerManager<numT> *answers = NULL);
+  numT run(answerManager<numT> *answers = NULL);
+};
+
+template <typename numT> void calcProgram<numT>::reset() {
+  this->code.clear();
+  this->numbers.clear();
+  this->vars.clear();
+  this->values.clear();
+  this->bound.clear();
+  this->temps.clear();
+  this->depth = 0;
+}
+
+template <typename numT>
+slong calcProgram<numT>::varIndex(constStr name) const {
+  for (ulong i = 0; i < this->vars.size(); ++i)
+    if (this->vars[i] == name)
+      return i;
+  return -1;
+}
+
+template <typename numT>
+slong calcProgram<numT>::varIndex(constStr name, const ulong len) const {
+  for (ulong i = 0; i < this->vars.size(); ++i)
+    if (this->vars[i].size() == len &&
+        not memcmp(this->vars[i].data(), name, len))
+      return i;
+  return -1;
+}
+
+template <typename numT>
+bool calcProgram<numT>::setVar(constStr name, const numT x) {
+  slong i = this->varIndex(name);
+  if (i < 0)
+    return 0;
+  this->setVar(i, x);
+  return 1;
+}
+
+template <typename numT>
+void calcProgram<numT>::setVar(const ulong i, const numT x) {
+  this->values[i] = x;
+  this->bound[i] = true;
+}
+
+template <typename numT> void calcProgram<numT>::emitNum(const numT x) {
+  this->code.push_back({I_num, this->numbers.size()});
+  this->numbers.push_back(x);
+  ++this->depth;
+}
+
+template <typename numT> void calcProgram<numT>::emitAns(const ulong pos) {
+  this->code.push_back({I_ans, pos});
+  ++this->depth;
+}
+
+template <typename numT>
+void calcProgram<numT>::emitVar(constStr name, const ulong len) {
+  std::string var(name, len);
+  ulong i = 0;
+  while (i < this->vars.size() && this->vars[i] != var)
+    ++i;
+  if (i == this->vars.size()) {
+    this->vars.push_back(var);
+    this->values.push_back(0);
+    this->bound.push_back(false);
+  }
+  this->code.push_back({I_var, i});
+  ++this->depth;
+}
+
+template <typename numT>
+ERROR calcProgram<numT>::emitOptr(const Operator &top) {
+  ulong operands = top.isUnary() ? 1 : 2;
+  if (this->depth < operands)
+    CALC_FAIL(numScarce);
+  this->depth -= operands - 1;
+  this->code.push_back({top.code(), 0});
+  return ERROR();
+}
+
+template <typename numT>
+numT calcProgram<numT>::run(answerManager<numT> *answers) {
+  numT y;
+  const ERROR e = this->run(y, answers);
+  if (e.isSet())
+    throw new ERROR(e);
+  return y;
+}
+
+template <typename numT>
+ERROR calcProgram<numT>::run(numT &ans, answerManager<numT> *answers) {
+  numT x, y, z;
+  this->stack.reset();
+  for (const instr &i : this->code) {
+    switch (i.type) {
+    case I_num:
+      if (not this->stack.push(this->numbers[i.arg]))
+        CALC_FAIL(memAlloc);
+      break;
+    case I_ans:
+      if (not answers)
+        CALC_FAIL(invalidAns);
+      CALC_TRY(answers->findAns(y, i.arg));
+      if (not this->stack.push(y))
+        CALC_FAIL(memAlloc);
+      break;
+    case I_var:
+      if (not this->bound[i.arg])
+        CALC_FAIL(varUndef);
+      if (not this->stack.push(this->values[i.arg]))
+        CALC_FAIL(memAlloc);
+      break;
+    case I_store:
+      this->stack.get(this->temps[i.arg]);
+      break;
+    case I_load:
+      if (not this->stack.push(this->temps[i.arg]))
+        CALC_FAIL(memAlloc);
+      break;
+    default: {
+      Operator top((Operator::optrCode)i.type);
+      x = 0;
+      // Operand counts were verified while compiling
+      this->stack.pop(y);
+      if (not top.isUnary())
+        this->stack.pop(x);
+      CALC_TRY(operate(top, x, y, z, this->angle));
+      if (not this->stack.push(z))
+        CALC_FAIL(memAlloc);
+    }
+    }
+  }
+  if (not this->stack.pop(ans))
+    CALC_FAIL(numScarce);
+  return ERROR();
+}
+
+#endif
+
+/*
+  Local Variables:
+  mode: c++
+  c-file-offset: 2
+  fill-column: 80
+  End:
+*/
@@ -0,0 +1,269 @@
+#ifndef CALC_RING_H
+#define CALC_RING_H
+
+#include <atomic>
+#include <climits>
+#include <linux/futex.h>
+#include <new>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.hpp"
+
+// A ring of records in memory shared by two processes, one of them writing
+// and the other reading. Records start on 8 bytes with a recordHeader and one
+// which doesn't fit before the end of the ring is put at its start, after a
+// padding record. head and tail count every byte ever written and read, so a
+// full ring isn't mistaken for an empty one.
+//
+// Neither side takes a lock or makes a system call while the other keeps up.
+// One that has to wait spins for a while and then sleeps on a futex, which
+// the other wakes only when somebody sleeps.
+struct recordHeader {
+  // Bytes of payload after the header
+  uint32_t size;
+  uint32_t type;
+};
+
+class calcRing {
+  struct header {
+    alignas(64) std::atomic<uint64_t> head;
+    alignas(64) std::atomic<uint64_t> tail;
+    // Bumped whenever head or tail moves. Sleepers wait on it.
+    alignas(64) std::atomic<uint32_t> events;
+    std::atomic<uint32_t> sleepers;
+    uint64_t size;
+  };
+
+  static const uint32_t padding = 0;
+
+  header *h;
+  char *data;
+  // Kept here as the other side could change the shared one
+  ulong size;
+  // Where the record being written goes
+  uint64_t writing;
+  // A record read didn't fit in the ring
+  mutable bool broken;
+
+  static ulong aligned(const ulong n) { return (n + 7) & ~7UL; }
+  // Times to look before sleeping. With one CPU the other side can't run
+  // while we spin.
+  static ulong spins() {
+    static const ulong n = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? 4000 : 0;
+    return n;
+  }
+  static void relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+  }
+  void notify();
+  const char *at(const uint64_t, recordHeader &) const;
+
+public:
+  // Bytes of shared memory taken by a ring with size bytes of records
+  static ulong bytes(const ulong size) { return sizeof(header) + size; }
+
+  calcRing() : h(NULL), data(NULL), size(0), writing(0), broken(false) {}
+  // A ring in memory made by format() earlier
+  explicit calcRing(void *memory)
+      : h((header *)memory), data((char *)memory + sizeof(header)),
+        size(h->size), writing(0), broken(false) {}
+  // Make an empty ring of size bytes, a power of 2, in memory
+  static calcRing format(void *memory, const ulong size);
+  // The size fits in memorySize bytes. Rings made by the other side are
+  // checked before use.
+  bool valid(const ulong memorySize) const {
+    const ulong s = this->size;
+    return s >= 64 && (s & (s - 1)) == 0 && bytes(s) <= memorySize;
+  }
+  // A record read was out of the ring, which can't be read any more
+  bool isBroken() const { return this->broken; }
+
+  // Writer: room for a record of type with bytes of payload, NULL if full.
+  // Nothing is seen by the reader until commit().
+  void *reserve(const uint32_t type, const ulong bytes);
+  void commit();
+  bool hasRoom(const ulong bytes) const;
+  // Largest record a ring of this size takes
+  ulong maxRecord() const { return this->size / 2 - sizeof(recordHeader); }
+
+  // Reader: the payload of the oldest record with its header copied to r, NULL
+  // if empty or broken. It stays there until release().
+  const char *peek(recordHeader &r) const;
+  void release();
+  bool isEmpty() const {
+    return this->h->tail.load(std::memory_order_relaxed) ==
+           this->h->head.load(std::memory_order_acquire);
+  }
+
+  // Wake whoever sleeps on the ring to look around
+  void wake() { this->notify(); }
+
+  // Wait until ready() or timeout nanoseconds pass. Returns false on timeout.
+  template <typename F> bool waitUntil(F ready, const long timeout);
+};
+
+inline calcRing calcRing::format(void *memory, const ulong size) {
+  header *h = new (memory) header;
+  h->head.store(0);
+  h->tail.store(0);
+  h->events.store(0);
+  h->sleepers.store(0);
+  h->size = size;
+  return calcRing(memory);
+}
+
+inline void calcRing::notify() {
+  this->h->events.fetch_add(1, std::memory_order_seq_cst);
+  if (this->h->sleepers.load(std::memory_order_seq_cst))
+    syscall(SYS_futex, (uint32_t *)&this->h->events, FUTEX_WAKE, INT_MAX, NULL,
+            NULL, 0);
+}
+
+inline bool calcRing::hasRoom(const ulong bytes) const {
+  const ulong need = sizeof(recordHeader) + aligned(bytes);
+  const ulong size = this->size;
+  if (need > size / 2)
+    return false;
+  const uint64_t head = this->h->head.load(std::memory_order_relaxed);
+  const uint64_t tail = this->h->tail.load(std::memory_order_acquire);
+  const ulong left = size - (head & (size - 1));
+  // A record which doesn't fit before the end skips to the start
+  const ulong skip = left < need ? left : 0;
+  return head + skip + need - tail <= size;
+}
+
+inline void *calcRing::reserve(const uint32_t type, const ulong bytes) {
+  if (not this->hasRoom(bytes))
+    return NULL;
+  const ulong need = sizeof(recordHeader) + aligned(bytes);
+  const ulong size = this->size;
+  uint64_t head = this->h->head.load(std::memory_order_relaxed);
+  const ulong left = size - (head & (size - 1));
+  const ulong skip = left < need ? left : 0;
+  if (skip) {
+    recordHeader *p = (recordHeader *)(this->data + (head & (size - 1)));
+    p->size = skip - sizeof(recordHeader);
+    p->type = padding;
+    head += skip;
+  }
+  recordHeader *r = (recordHeader *)(this->data + (head & (size - 1)));
+  r->size = bytes;
+  r->type = type;
+  this->writing = head + need;
+  return r + 1;
+}
+
+inline void calcRing::commit() {
+  this->h->head.store(this->writing, std::memory_order_release);
+  this->notify();
+}
+
+// The payload of the record at position p with its header copied to r, NULL
+// if it doesn't fit in the ring
+inline const char *calcRing::at(const uint64_t p, recordHeader &r) const {
+  const ulong offset = p & (this->size - 1);
+  memcpy(&r, this->data + offset, sizeof(r));
+  if (offset + sizeof(recordHeader) + aligned(r.size) > this->size) {
+    this->broken = true;
+    return NULL;
+  }
+  return this->data + offset + sizeof(recordHeader);
+}
+
+inline const char *calcRing::peek(recordHeader &r) const {
+  const uint64_t tail = this->h->tail.load(std::memory_order_relaxed);
+  const uint64_t head = this->h->head.load(std::memory_order_acquire);
+  if (tail == head || this->broken)
+    return NULL;
+  const char *p = this->at(tail, r);
+  if (p == NULL || r.type != padding)
+    return p;
+  // Padding is never the last record written
+  return this->at(tail + sizeof(recordHeader) + r.size, r);
+}
+
+inline void calcRing::release() {
+  uint64_t tail = this->h->tail.load(std::memory_order_relaxed);
+  recordHeader r;
+  const char *p = this->at(tail, r);
+  if (p != NULL && r.type == padding) {
+    tail += sizeof(recordHeader) + r.size;
+    p = this->at(tail, r);
+  }
+  if (p == NULL)
+    return;
+  tail += sizeof(recordHeader) + aligned(r.size);
+  this->h->tail.store(tail, std::memory_order_release);
+  this->notify();
+}
+
+template <typename F>
+bool calcRing::waitUntil(F ready, const long timeout) {
+  for (ulong i = 0, n = spins(); i < n; ++i) {
+    if (ready())
+      return true;
+    relax();
+  }
+  timespec t = {timeout / 1000000000, timeout % 1000000000};
+  const uint32_t seen = this->h->events.load(std::memory_order_acquire);
+  this->h->sleepers.fetch_add(1, std::memory_order_seq_cst);
+  // Checked again after saying we sleep, so that a notify() in between is seen
+  // either here or by the futex
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (not ready())
+    syscall(SYS_futex, (uint32_t *)&this->h->events, FUTEX_WAIT, seen, &t, NULL,
+            0);
+  this->h->sleepers.fetch_sub(1, std::memory_order_seq_cst);
+  return ready();
+}
+
+// What a client of calcServer shares with it: a ring of requests and a ring
+// of replies, each record of one being answered by a record of the other of
+// the same type in the same order. Numbers are in the machine's own order as
+// both sides are on it.
+//   evaluate  the expression
+//   prepare   the id, a NUL and the expression
+//   exec      an execRequest, the values of the first count variables in the
+//             order they appear in the expression and the id
+// Every reply is a reply record. The ans of prepare is its number of variables.
+namespace calcChannel {
+enum { evaluate = 1, prepare, exec };
+
+struct execRequest {
+  uint32_t count;
+  uint32_t idLength;
+};
+
+struct reply {
+  // ERROR code, 0 if none
+  int32_t error;
+  uint32_t flags;
+  uint64_t position;
+  double ans;
+};
+enum { hasAns = 1, hasPosition = 2 };
+
+// Bytes of each ring
+static const ulong ringSize = 1 << 16;
+
+inline ulong bytes() { return 2 * calcRing::bytes(ringSize); }
+inline calcRing requests(void *memory) { return calcRing(memory); }
+inline calcRing replies(void *memory) {
+  return calcRing((char *)memory + calcRing::bytes(ringSize));
+}
+} // namespace calcChannel
+
+#endif
+
+/*
+  Local Variables:
+  mode: c++
+  c-file-offset: 2
+  fill-column: 80
+  End:
+*/
@@ -1,45 +1,96 @@
 #include <string.h>
 #include <unistd.h>
 #include <arpa/inet.h>
-#include <future>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <errno.h>
+#include <fcntl.h>
 #include <map>
+#include <mutex>
+#include <poll.h>
 #include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <thread>
+#include <vector>
 
-#include "calcParser.hpp"
+#include "calcLog.hpp"
+#include "calcRing.hpp"
+#include "calcSession.hpp"
+#include "calcUring.hpp"
 
-inline const char *execute(constStr input) {
-  char *retVal = new char[300];
-  try { // Parsing the input
-    calcParse<float64_t> parser(input);
-    parser.startParsing();
-    sprintf(retVal, "{ \"ans\": %lf }", parser.Ans());
-  } catch (ERROR *e) { // Catch any errors
-    if (e->isSet()) {
-      sprintf(retVal, "{ \"error\": \"%s\" }", e->toString());
-    }
-    delete e;
-  }
-  return retVal;
-}
+// A single thread waits on epoll for every socket and only moves bytes.
+// Requests are answered by a fixed pool of workers, which get all the complete
+// lines a client has sent at once(up to maxJob bytes). A client has at most one
+// job with the workers, so its answers stay in order, and the reactor hears of
+// finished ones through an eventfd. Replies waiting for the socket are queued
+// and sent together with a single sendmsg().
+//
+// Or there are shards, each a calcServer of its own with a thread running its
+// loop and a listening socket on the same port(SO_REUSEPORT), answering the
+// requests of its clients itself. They share the log and the stats, which are
+// written per thread, and the cache of shared answers, whose 16 locks they may
+// contend on.
+//
+// On kernels with io_uring the loop can wait on a ring instead(-e uring).
+// Listeners accept and sockets receive through multishot requests, into
+// buffers of the ring, and the sends of every client go out with the wait for
+// what comes next in a single system call.
+//
+// Clients on the same machine may also connect to a unix socket, which takes
+// the same requests. One of them can instead send a memfd with the line SHM
+// and talk through the rings of calcChannel in it from then on. A thread of
+// its own answers those, so a request costs no system call while the client
+// keeps it busy.
+//
+// Nothing on the way of a request waits for the log: messages go to the
+// calcLog ring of the thread writing them and a thread of the log prints them.
+// Those of every request are at debug and off by default.
+//
+// With a stats port, connecting to it and sending STATS gets a line of JSON
+// with the numbers calcStats keeps and sending an HTTP GET gets them for
+// Prometheus.
+//
+// Expressions which don't refer to answers are answered once for everybody
+// through calcCache, unless it is turned off with -c 0.
+calcLog serverLog;
+calcStats serverStats;
+calcCache serverCache(1 << 16);
 
 class calcServer {
   struct IPCdetails {
     int fd = 0;
-    socklen_t length = sizeof(address);
-    sockaddr_in address;
+    socklen_t length = sizeof(local);
+    union {
+      sockaddr_in address;
+      sockaddr_un local;
+    };
     IPCdetails() {
-      memset(&address, 0, length);
+      memset(&local, 0, length);
     }
     void close() {
       if (fd > 0) {
-        debug("Killing myself");
+        debug(calcLog::debug, "Killing myself");
         ::close(fd);
         fd = 0;
-        memset(&address, 0, length);
-        debug("Killed");
+        memset(&local, 0, sizeof(local));
+        debug(calcLog::debug, "Killed");
       }
     }
+    bool isLocal() const {
+      return local.sun_family == AF_UNIX;
+    }
     const std::string getAddress() const {
+      if (fd > 0 && isLocal()) {
+        if (local.sun_path[0])
+          return local.sun_path;
+        return "local client " + std::to_string(fd);
+      }
       if (fd > 0) {
         std::string a = inet_ntoa(address.sin_addr);
         a += ":" + std::to_string(ntohs(address.sin_port));
@@ -47,56 +98,805 @@ class calcServer {
       }
       return "undefined address";
     }
-    void debug(const std::string s) const {
-      std::cout << getAddress() << "> " << s << "\n";
+    void debug(const calcLog::level l, constStr format, ...) const
+        __attribute__((format(printf, 3, 4))) {
+      if (not serverLog.wants(l))
+        return;
+      va_list args;
+      va_start(args, format);
+      serverLog.write(l, getAddress().c_str(), format, args);
+      va_end(args);
     }
     socklen_t *getLength() {
-      length = sizeof(address);
+      length = isLocal() ? sizeof(local) : sizeof(address);
       return &length;
     }
     ~IPCdetails() {
       close();
     }
-  } server;
-  std::map<std::string, std::shared_ptr<IPCdetails>> clients;
-  std::map<std::string, std::shared_future<void>> clientHandles;
-  int numberOfConnections = 0;
-  int maxClients = 10;
-  std::mutex class_mutex;
-  void runCommands(std::shared_ptr<IPCdetails> client) {
-    client->debug("Thread launched");
-    std::string expr;
-    do {
-      expr = "";
-      char s[256];
-      int len;
-      client->debug("Waiting for message");
-      while (true) {
-        len = 255;
-        len = read(client->fd, s, len);
-        if (len > 0 && s[len - 2] == '\n') {
-          s[len - 2] = '\0';
-          expr += s;
-          break;
-        } else if (len <= 0) {
-          client->debug("Connection closed");
-          dropClient(client->getAddress());
+  } server, localServer, statsServer;
+
+  // The shared memory of a client and the thread answering the requests in
+  // it with a session of its own
+  struct channel {
+    void *memory = MAP_FAILED;
+    calcRing requests;
+    calcRing replies;
+    calcSession calc;
+    // The request being answered, out of reach of the client
+    std::string request;
+    std::atomic<bool> stop{false};
+    std::thread thread;
+    ~channel() {
+      stop = true;
+      if (thread.joinable()) {
+        requests.wake();
+        replies.wake();
+        thread.join();
+      }
+      if (memory != MAP_FAILED)
+        munmap(memory, calcChannel::bytes());
+    }
+  };
+
+  // A connected client. Only the reactor touches it, except for calc, work
+  // and replies which belong to the worker while busy is set.
+  struct client {
+    IPCdetails ipc;
+    calcSession calc;
+    // Received. Bytes before inStart are answered already.
+    std::string in;
+    ulong inStart = 0;
+    // Stopped reading as too much is waiting
+    bool throttled = false;
+    // Replies not sent yet, oldest first, and the bytes of the first one sent
+    std::deque<std::string> out;
+    ulong outSent = 0;
+    ulong outBytes = 0;
+    // Used buffers kept for later replies
+    std::vector<std::string> spare;
+    // Lines the worker answers and their replies
+    std::string work;
+    std::string replies;
+    bool busy = false;
+    // Sent everything it will. Dropped once that is answered.
+    bool eof = false;
+    // The client is gone. Dropped once the worker is done with it.
+    bool gone = false;
+    // Asked to quit. Dropped once the replies are sent.
+    bool quitting = false;
+    bool quit = false;
+    // Talks through shared memory. Anything else it sends is ignored.
+    std::unique_ptr<channel> shm;
+    // Came to the stats port
+    bool stats = false;
+    // When the job with the workers was handed over
+    uint64_t dispatched = 0;
+    // With io_uring: whether a receive and a send are queued, and the
+    // message of the send. generation tells completions for an earlier client
+    // with the same fd apart.
+    bool receiving = false;
+    bool cancelled = false;
+    bool sending = false;
+    msghdr message;
+    iovec vectors[64];
+    uint32_t generation = 0;
+  };
+
+  // Bytes of requests handed to a worker at once
+  static const ulong maxJob = 1 << 16;
+  // Bytes received but not answered or answered but not sent before the
+  // client is made to wait
+  static const ulong maxPending = 1 << 22;
+
+  int epollFd = -1;
+  int wakeFd = -1;
+  // Used instead of epoll when open
+  calcUring uring;
+  bool wantUring = false;
+  uint32_t generations = 0;
+  std::map<int, std::unique_ptr<client>> clients;
+  uint workerCount = 0;
+  // A shard answers requests in its own loop instead of with workers, and
+  // shares its port with the other shards
+  bool sharded = false;
+  std::vector<std::thread> workers;
+  std::mutex jobLock;
+  std::condition_variable jobReady;
+  std::deque<client *> jobs;
+  bool stopping = false;
+  // Answered by the workers and not yet seen by the reactor
+  std::mutex doneLock;
+  std::vector<client *> done;
+  // Set by signals to end the loop, of this shard or another
+  std::atomic<bool> quitting{false};
+
+  void work() {
+    while (true) {
+      client *c;
+      {
+        std::unique_lock<std::mutex> l(jobLock);
+        jobReady.wait(l, [this] { return stopping || not jobs.empty(); });
+        if (stopping)
           return;
-        }
-        client->debug("Didn't get '\\n'. Reading again.");
-      }
-      char c[1000];
-      sprintf(c, "Received '%s'", expr.c_str());
-      client->debug(c);
-      const char *value = execute(expr.c_str());
-      sprintf(c, "Sending '%s'", value);
-      client->debug(c);
-      send(client->fd, value, strlen(value), 0);
-      delete value;
-    } while (expr != "exit" && expr != "quit");
-    dropClient(client->getAddress());
+        c = jobs.front();
+        jobs.pop_front();
+      }
+      c->quit = not c->calc.answer(c->work.data(),
+                                   c->work.data() + c->work.size(),
+                                   c->replies);
+      {
+        std::lock_guard<std::mutex> l(doneLock);
+        done.push_back(c);
+      }
+      const uint64_t one = 1;
+      if (write(wakeFd, &one, sizeof(one)) < 0)
+        server.debug(calcLog::error, "Can't wake the reactor");
+    }
+  }
+
+  void watch(const int fd, const uint32_t events) {
+    epoll_event ev;
+    ev.events = events;
+    ev.data.fd = fd;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev);
+  }
+
+  void acceptClients(IPCdetails &listener) {
+    while (true) {
+      auto c = std::unique_ptr<client>(new client);
+      c->ipc.local.sun_family = listener.local.sun_family;
+      c->ipc.fd = accept4(listener.fd, (sockaddr *)&c->ipc.local,
+                          c->ipc.getLength(), SOCK_NONBLOCK);
+      if (c->ipc.fd < 0) {
+        c->ipc.fd = 0;
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+          listener.debug(calcLog::warning, "Can't connect to client");
+        return;
+      }
+      welcome(listener, std::move(c));
+    }
+  }
+
+  // Start serving a client accepted by listener
+  void welcome(IPCdetails &listener, std::unique_ptr<client> c) {
+    c->ipc.debug(calcLog::info, "Welcome");
+    c->stats = &listener == &statsServer;
+    c->calc.measure(&serverStats);
+    c->calc.share(&serverCache);
+    if (not c->stats)
+      serverStats.connected(1);
+    const int fd = c->ipc.fd;
+    client &added = *c;
+    clients[fd] = std::move(c);
+    if (uring.isOpen()) {
+      added.generation = ++generations;
+      listenTo(added);
+    } else {
+      watch(fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET);
+    }
+  }
+
+  // Answer the requests of a channel until the client goes
+  void serveChannel(channel *ch) {
+    const long idle = 1000000000;
+    // Aligned for the values of exec
+    std::vector<float64_t> request;
+    std::string id;
+    while (not ch->stop) {
+      recordHeader h;
+      const char *p = ch->requests.peek(h);
+      if (p == NULL) {
+        if (ch->requests.isBroken())
+          break;
+        ch->requests.waitUntil(
+            [ch] { return ch->stop || not ch->requests.isEmpty(); }, idle);
+        continue;
+      }
+      const ulong room = sizeof(calcChannel::reply);
+      if (not ch->replies.hasRoom(room)) {
+        ch->replies.waitUntil(
+            [ch, room] { return ch->stop || ch->replies.hasRoom(room); }, idle);
+        continue;
+      }
+      // Copied as the client could change it while it is read
+      request.resize(h.size / sizeof(float64_t) + 1);
+      memcpy(request.data(), p, h.size);
+      ch->requests.release();
+
+      calcSession::result r = calcSession::result();
+      answer(*ch, h.type, (constStr)request.data(), h.size, id, r);
+      calcChannel::reply *out =
+          (calcChannel::reply *)ch->replies.reserve(h.type, room);
+      out->error = r.e.code();
+      out->flags = (r.hasAns ? calcChannel::hasAns : 0) |
+                   (r.hasPosition ? calcChannel::hasPosition : 0);
+      out->position = r.position;
+      out->ans = r.ans;
+      ch->replies.commit();
+    }
+    if (ch->requests.isBroken())
+      server.debug(calcLog::warning, "A shared memory channel is broken");
+  }
+
+  static void answer(channel &ch, const uint32_t type, constStr p,
+                     const ulong size, std::string &id,
+                     calcSession::result &r) {
+    constStr end = p + size;
+    if (type == calcChannel::evaluate) {
+      ch.calc.evaluate(p, end, r);
+    } else if (type == calcChannel::prepare) {
+      constStr nul = (constStr)memchr(p, '\0', size);
+      if (nul == NULL) {
+        r.e = ERROR::invalidCmd;
+        return;
+      }
+      id.assign(p, nul - p);
+      const calcSession::program *program = ch.calc.prepare(id, nul + 1, end, r);
+      if (program != NULL) {
+        r.hasAns = true;
+        r.ans = program->varCount();
+      }
+    } else if (type == calcChannel::exec) {
+      calcChannel::execRequest e;
+      if (size < sizeof(e)) {
+        r.e = ERROR::invalidCmd;
+        return;
+      }
+      memcpy(&e, p, sizeof(e));
+      const ulong values = sizeof(e) + (ulong)e.count * sizeof(float64_t);
+      if (values + e.idLength > size) {
+        r.e = ERROR::invalidCmd;
+        return;
+      }
+      id.assign(p + values, e.idLength);
+      ch.calc.exec(id, (const float64_t *)(p + sizeof(e)), e.count, r);
+    } else {
+      r.e = ERROR::invalidCmd;
+    }
+  }
+
+  // Map the memfd of a client asking for a channel and start answering it.
+  // The reply says whether that worked, and the client goes if it didn't.
+  void attach(client &c, const int fd) {
+    const ulong size = calcChannel::bytes();
+    // The client mustn't be able to shrink it under our feet
+    const int seals = fcntl(fd, F_GET_SEALS);
+    struct stat s;
+    void *memory = MAP_FAILED;
+    if (seals >= 0 && (seals & F_SEAL_SHRINK) && fstat(fd, &s) == 0 &&
+        (ulong)s.st_size >= size)
+      memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (memory != MAP_FAILED) {
+      auto ch = std::unique_ptr<channel>(new channel);
+      ch->memory = memory;
+      ch->requests = calcChannel::requests(memory);
+      ch->replies = calcChannel::replies(memory);
+      ch->calc.measure(&serverStats);
+      ch->calc.share(&serverCache);
+      const ulong ring = calcRing::bytes(calcChannel::ringSize);
+      if (ch->requests.valid(ring) && ch->replies.valid(ring)) {
+        ch->thread = startThread(&calcServer::serveChannel, this, ch.get());
+        c.shm = std::move(ch);
+        serverStats.attached(1);
+      }
+    }
+    std::string reply = "{ \"shm\": true }\n";
+    if (c.shm) {
+      c.ipc.debug(calcLog::info, "Talking through shared memory");
+    } else {
+      reply = "{ \"error\": \"";
+      reply += ERROR(ERROR::ioError).toString();
+      reply += "\" }\n";
+      c.quitting = true;
+    }
+    c.outBytes += reply.size();
+    c.out.push_back(std::move(reply));
+  }
+
+  // Read from a unix socket, where a memfd may come with the first line
+  ssize_t receiveLocal(client &c, char *buf, const ulong size) {
+    iovec v = {buf, size};
+    char control[CMSG_SPACE(sizeof(int))];
+    msghdr m;
+    memset(&m, 0, sizeof(m));
+    m.msg_iov = &v;
+    m.msg_iovlen = 1;
+    m.msg_control = control;
+    m.msg_controllen = sizeof(control);
+    const ssize_t len = recvmsg(c.ipc.fd, &m, MSG_CMSG_CLOEXEC);
+    cmsghdr *h = CMSG_FIRSTHDR(&m);
+    if (len <= 0 || h == NULL || h->cmsg_level != SOL_SOCKET ||
+        h->cmsg_type != SCM_RIGHTS)
+      return len;
+    int fd;
+    memcpy(&fd, CMSG_DATA(h), sizeof(fd));
+    if (c.shm || c.quitting || not c.in.empty() || len < 4 ||
+        memcmp(buf, "SHM\n", 4))
+      ::close(fd);
+    else
+      attach(c, fd);
+    return len;
+  }
+
+  // Stop reading from the client until its replies are sent
+  static bool waitsTooMuch(const client &c) {
+    return c.in.size() - c.inStart + c.outBytes > maxPending;
+  }
+
+  // Read everything available or until too much is waiting. Returns false on
+  // errors.
+  bool receive(client &c) {
+    char buf[16384];
+    c.throttled = false;
+    while (true) {
+      if (waitsTooMuch(c)) {
+        c.throttled = true;
+        return true;
+      }
+      const ssize_t len = c.ipc.isLocal()
+                              ? receiveLocal(c, buf, sizeof(buf))
+                              : read(c.ipc.fd, buf, sizeof(buf));
+      if (len > 0) {
+        received(c, buf, len);
+        continue;
+      }
+      if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return true;
+      if (len < 0 && errno == EINTR)
+        continue;
+      return closed(c, len < 0);
+    }
+  }
+
+  static void received(client &c, constStr buf, const ulong len) {
+    if (not c.shm && not c.quitting)
+      c.in.append(buf, len);
+  }
+
+  // The client has sent everything, or failed if failed. Returns false then.
+  bool closed(client &c, const bool failed) {
+    if (c.eof && not failed)
+      return true;
+    c.ipc.debug(calcLog::info, "Connection closed");
+    if (failed)
+      return false;
+    // The last request may lack its newline
+    const ulong last = c.in.find_last_not_of('\0');
+    if (last != std::string::npos && last >= c.inStart && c.in[last] != '\n')
+      c.in += '\n';
+    c.eof = true;
+    return true;
+  }
+
+  // Send as much of the replies as the socket takes. Returns false on errors.
+  bool transmit(client &c) {
+    if (uring.isOpen()) {
+      if (not c.sending && not c.out.empty())
+        post(c);
+      return true;
+    }
+    while (not c.out.empty()) {
+      iovec v[64];
+      msghdr m;
+      memset(&m, 0, sizeof(m));
+      m.msg_iov = v;
+      m.msg_iovlen = gather(c, v);
+      // A client gone before its replies is an EPIPE, not a signal
+      const ssize_t len = sendmsg(c.ipc.fd, &m, MSG_NOSIGNAL);
+      if (len < 0)
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+      sent(c, len);
+    }
+    return true;
+  }
+
+  // Point v at the replies to send, up to 64 of them
+  static int gather(const client &c, iovec *v) {
+    int n = 0;
+    for (auto i = c.out.begin(); i != c.out.end() && n < 64; ++i, ++n) {
+      const ulong skip = n ? 0 : c.outSent;
+      v[n].iov_base = (void *)(i->data() + skip);
+      v[n].iov_len = i->size() - skip;
+    }
+    return n;
+  }
+
+  // len bytes of the replies went out
+  static void sent(client &c, const ulong len) {
+    c.outBytes -= len;
+    ulong done = c.outSent + len;
+    while (not c.out.empty() && done >= c.out.front().size()) {
+      done -= c.out.front().size();
+      if (c.spare.size() < 4)
+        c.spare.push_back(std::move(c.out.front()));
+      c.out.pop_front();
+    }
+    c.outSent = done;
+  }
+
+  // Answer a client of the stats port once it has asked, then let it go
+  void answerStats(client &c) {
+    const bool http = c.in.compare(0, 4, "GET ") == 0;
+    if (http ? c.in.find("\r\n\r\n") == std::string::npos &&
+                   c.in.find("\n\n") == std::string::npos && not c.eof
+             : c.in.find('\n') == std::string::npos)
+      return;
+    calcStats::gauges g;
+    {
+      std::lock_guard<std::mutex> l(jobLock);
+      g.queue = jobs.size();
+    }
+    std::string reply;
+    if (http) {
+      const std::string body = serverStats.prometheus(g);
+      reply = "HTTP/1.0 200 OK\r\n"
+              "Content-Type: text/plain; version=0.0.4\r\n"
+              "Content-Length: " + std::to_string(body.size()) + "\r\n\r\n";
+      reply += body;
+    } else if (c.in.compare(0, 5, "STATS") == 0) {
+      reply = serverStats.json(g);
+    } else {
+      reply = "{ \"error\": \"";
+      reply += ERROR(ERROR::invalidCmd).toString();
+      reply += "\" }\n";
+    }
+    c.in.clear();
+    c.outBytes += reply.size();
+    c.out.push_back(std::move(reply));
+    c.quitting = true;
+  }
+
+  // Hand the complete lines received to a worker. A shard answers them at
+  // once instead and returns true.
+  bool dispatch(client &c) {
+    if (c.busy || c.gone || c.quitting || c.outBytes > maxPending)
+      return false;
+    constStr start = c.in.data() + c.inStart, end = c.in.data() + c.in.size();
+    const ulong len = calcSession::completeLines(start, end, maxJob);
+    if (len == 0) {
+      if ((ulong)(end - start) > maxPending) {
+        c.ipc.debug(calcLog::warning, "Request too long");
+        c.gone = true;
+      }
+      return false;
+    }
+    c.work.assign(start, len);
+    c.inStart += len;
+    // Keep the unanswered bytes at the start once the answered ones are many
+    if (c.inStart == c.in.size()) {
+      c.in.clear();
+      c.inStart = 0;
+    } else if (c.inStart > c.in.size() / 2) {
+      c.in.erase(0, c.inStart);
+      c.inStart = 0;
+    }
+    c.ipc.debug(calcLog::debug, "Received %lu bytes of requests", len);
+    if (c.spare.empty()) {
+      c.replies.clear();
+    } else {
+      c.replies = std::move(c.spare.back());
+      c.spare.pop_back();
+      c.replies.clear();
+    }
+    c.busy = true;
+    c.dispatched = calcStats::now();
+    if (sharded) {
+      c.quit = not c.calc.answer(c.work.data(), c.work.data() + c.work.size(),
+                                 c.replies);
+      finished(c);
+      return true;
+    }
+    {
+      std::lock_guard<std::mutex> l(jobLock);
+      jobs.push_back(&c);
+    }
+    jobReady.notify_one();
+    return false;
+  }
+
+  void dropClient(const int fd) {
+    auto i = clients.find(fd);
+    if (i == clients.end())
+      return;
+    client &c = *i->second;
+    // The socket stays open until the receive of io_uring is over, so that
+    // the fd isn't reused meanwhile
+    if (c.receiving && not c.cancelled) {
+      uring.cancel(ioData(c.ipc.isLocal() ? ioPoll : ioReceive, c));
+      c.cancelled = true;
+    }
+    // The worker still uses it, or the kernel the socket or the replies
+    if (c.busy || c.sending || c.receiving) {
+      c.gone = true;
+      return;
+    }
+    if (epollFd >= 0)
+      epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, NULL);
+    if (i->second->shm)
+      serverStats.attached(-1);
+    if (not i->second->stats)
+      serverStats.connected(-1);
+    clients.erase(i);
+  }
+
+  // Send what can be sent and hand over more work. Drops the client if it is
+  // done.
+  void progress(client &c) {
+    if (c.stats && not c.quitting)
+      answerStats(c);
+    do {
+      if (not c.gone && not transmit(c))
+        c.gone = true;
+      if (c.quitting && c.out.empty())
+        c.gone = true;
+      if (c.gone)
+        return dropClient(c.ipc.fd);
+      if (c.throttled && not resume(c))
+        return dropClient(c.ipc.fd);
+    } while (dispatch(c));
+    if (c.gone || (c.eof && not c.busy && c.out.empty()))
+      dropClient(c.ipc.fd);
+  }
+
+  // Read again from a throttled client. Returns false on errors.
+  bool resume(client &c) {
+    if (not uring.isOpen() || c.ipc.isLocal())
+      return receive(c);
+    // Once the receive cancelled by throttle() is done
+    if (not c.receiving && not waitsTooMuch(c)) {
+      c.throttled = false;
+      listenTo(c);
+    }
+    return true;
+  }
+
+  // The replies of a job are there
+  void finished(client &c) {
+    c.busy = false;
+    serverStats.record(calcStats::job, c.dispatched, ERROR());
+    if (not c.replies.empty()) {
+      c.ipc.debug(calcLog::debug, "Sending %lu bytes of replies",
+                  c.replies.size());
+      c.outBytes += c.replies.size();
+      c.out.push_back(std::move(c.replies));
+    }
+    c.quitting = c.quit;
+  }
+
+  void finishJobs() {
+    uint64_t count;
+    if (read(wakeFd, &count, sizeof(count)) < 0)
+      return;
+    std::vector<client *> finished;
+    {
+      std::lock_guard<std::mutex> l(doneLock);
+      finished.swap(done);
+    }
+    for (client *c : finished) {
+      this->finished(*c);
+      progress(*c);
+    }
+  }
+
+  // What io_uring completions are for. Those of clients have the low 24 bits
+  // of their generation above the fd.
+  enum ioKind : uint64_t {
+    ioAccept = 1,
+    ioWake,
+    ioReceive,
+    ioPoll,
+    ioSend,
+    ioRetry
+  };
+
+  static uint64_t ioData(const ioKind k, const int fd,
+                         const uint32_t generation = 0) {
+    return (uint64_t)k << 56 | (uint64_t)(generation & 0xffffff) << 32 |
+           (uint32_t)fd;
+  }
+  static uint64_t ioData(const ioKind k, const client &c) {
+    return ioData(k, c.ipc.fd, c.generation);
+  }
+
+  // Have io_uring tell what the client sends. Sockets are received from by
+  // the ring and unix sockets, where memfds may come, only polled.
+  void listenTo(client &c) {
+    if (c.ipc.isLocal())
+      uring.poll(c.ipc.fd, POLLIN | POLLRDHUP, ioData(ioPoll, c));
+    else
+      uring.receive(c.ipc.fd, ioData(ioReceive, c));
+    c.receiving = true;
+  }
+
+  // Send the replies waiting through io_uring
+  void post(client &c) {
+    memset(&c.message, 0, sizeof(c.message));
+    c.message.msg_iov = c.vectors;
+    c.message.msg_iovlen = gather(c, c.vectors);
+    uring.send(c.ipc.fd, &c.message, ioData(ioSend, c));
+    c.sending = true;
+  }
+
+  // A client is received from faster than it reads its replies
+  void throttle(client &c) {
+    if (c.throttled)
+      return;
+    c.throttled = true;
+    uring.cancel(ioData(ioReceive, c));
+  }
+
+  void complete(const io_uring_cqe &e) {
+    const ioKind k = (ioKind)(e.user_data >> 56);
+    const int fd = (int)(uint32_t)e.user_data;
+    const bool more = e.flags & IORING_CQE_F_MORE;
+    if (k == ioAccept) {
+      IPCdetails &listener = fd == server.fd        ? server
+                             : fd == localServer.fd ? localServer
+                                                    : statsServer;
+      if (e.res >= 0) {
+        auto c = std::unique_ptr<client>(new client);
+        c->ipc.local.sun_family = listener.local.sun_family;
+        c->ipc.fd = e.res;
+        getpeername(e.res, (sockaddr *)&c->ipc.local, c->ipc.getLength());
+        welcome(listener, std::move(c));
+      } else if (e.res == -EMFILE || e.res == -ENFILE || e.res == -ENOBUFS ||
+                 e.res == -ENOMEM) {
+        // Accepting again at once would fail the same way until clients
+        // leave, so wait a bit
+        static const __kernel_timespec pause = {0, 100000000};
+        listener.debug(calcLog::warning, "Can't connect to client: %s",
+                       strerror(-e.res));
+        if (not more && not quitting)
+          uring.timeout(&pause, ioData(ioRetry, fd));
+        return;
+      } else if (e.res == -EBADF || e.res == -EINVAL || e.res == -ENOTSOCK ||
+                 e.res == -EOPNOTSUPP) {
+        listener.debug(calcLog::error, "Can't accept clients: %s",
+                       strerror(-e.res));
+        return;
+      } else if (e.res != -EAGAIN && e.res != -EINTR && e.res != -ECANCELED) {
+        listener.debug(calcLog::warning, "Can't connect to client");
+      }
+      if (not more && not quitting)
+        uring.accept(fd, e.user_data);
+      return;
+    }
+    if (k == ioRetry) {
+      if (not quitting)
+        uring.accept(fd, ioData(ioAccept, fd));
+      return;
+    }
+    if (k == ioWake) {
+      finishJobs();
+      if (not more)
+        uring.poll(wakeFd, POLLIN, e.user_data);
+      return;
+    }
+
+    auto i = clients.find(fd);
+    client *c = i != clients.end() &&
+                        ioData(k, *i->second) == e.user_data
+                    ? i->second.get()
+                    : NULL;
+    if (k == ioReceive) {
+      if (e.flags & IORING_CQE_F_BUFFER) {
+        const uint16_t id = e.flags >> IORING_CQE_BUFFER_SHIFT;
+        if (c != NULL && e.res > 0)
+          received(*c, uring.buffer(id), e.res);
+        uring.recycle(id);
+      }
+      if (c == NULL)
+        return;
+      if (not more)
+        c->receiving = false;
+      if (c->gone)
+        return progress(*c);
+      if (e.res > 0 && waitsTooMuch(*c))
+        throttle(*c);
+      else if (e.res == 0 && not closed(*c, false))
+        c->gone = true;
+      else if (e.res < 0 && e.res != -ECANCELED && e.res != -ENOBUFS &&
+               not closed(*c, true))
+        c->gone = true;
+      // Out of buffers for now
+      if (not c->receiving && not c->throttled && not c->eof && not c->gone)
+        listenTo(*c);
+    } else if (k == ioPoll) {
+      if (c == NULL)
+        return;
+      if (not more)
+        c->receiving = false;
+      if (c->gone)
+        return progress(*c);
+      if (not receive(*c))
+        c->gone = true;
+      else if (not c->receiving && not c->eof)
+        listenTo(*c);
+    } else if (k == ioSend) {
+      if (c == NULL)
+        return;
+      c->sending = false;
+      if (e.res < 0)
+        c->gone = true;
+      else
+        sent(*c, e.res);
+    } else {
+      return;
+    }
+    progress(*c);
+  }
+
+  // The loop with io_uring
+  void runUring() {
+    for (IPCdetails *l : {&server, &localServer, &statsServer})
+      if (l->fd > 0)
+        uring.accept(l->fd, ioData(ioAccept, l->fd));
+    uring.poll(wakeFd, POLLIN, ioData(ioWake, wakeFd));
+    while (not quitting) {
+      if (not uring.submit()) {
+        server.debug(calcLog::error, "io_uring_enter failed: %s",
+                     strerror(errno));
+        break;
+      }
+      uring.each([this](const io_uring_cqe &e) { complete(e); });
+    }
+  }
+
+  // The loop with epoll
+  void runEpoll() {
+    for (IPCdetails *l : {&server, &localServer, &statsServer})
+      if (l->fd > 0)
+        watch(l->fd, EPOLLIN);
+    watch(wakeFd, EPOLLIN);
+    epoll_event events[256];
+    while (not quitting) {
+      const int count = epoll_wait(epollFd, events, 256, -1);
+      if (count < 0 && errno != EINTR) {
+        server.debug(calcLog::error, "epoll_wait failed");
+        break;
+      }
+      for (int i = 0; i < count && not quitting; ++i) {
+        const int fd = events[i].data.fd;
+        if (fd == server.fd)
+          acceptClients(server);
+        else if (fd == localServer.fd)
+          acceptClients(localServer);
+        else if (fd == statsServer.fd)
+          acceptClients(statsServer);
+        else if (fd == wakeFd)
+          finishJobs();
+        else
+          serveClient(fd, events[i].events);
+      }
+    }
   }
+
+  void serveClient(const int fd, const uint32_t events) {
+    auto i = clients.find(fd);
+    if (i == clients.end())
+      return;
+    client &c = *i->second;
+    if (c.gone)
+      return;
+    if ((events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) &&
+        not receive(c))
+      c.gone = true;
+    progress(c);
+  }
+
 public:
+  // Threads other than the reactor leave signals to it, so that they interrupt
+  // epoll_wait()
+  template <typename... A> static std::thread startThread(A &&... a) {
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    std::thread t(std::forward<A>(a)...);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return t;
+  }
 
   calcServer(sa_family_t server_byte_order = AF_INET,
              in_addr_t ip_address = INADDR_ANY,
@@ -104,6 +904,7 @@ public:
     server.address.sin_family = server_byte_order;
     server.address.sin_addr.s_addr = ip_address;
     server.address.sin_port = htons(port);
+    wakeFd = eventfd(0, EFD_NONBLOCK);
   }
 
   void init(sa_family_t server_byte_order = AF_INET,
@@ -121,104 +922,253 @@ public:
       server.address.sin_port = htons(std::stoi(port));
   }
 
+  // Number of threads evaluating expressions. 0 uses every core.
+  void set_workers(const uint n) {
+    workerCount = n;
+  }
+
+  // Make this one of the shards sharing the port, each with its own loop and
+  // no workers
+  void set_sharded() {
+    sharded = true;
+  }
+
+  // Wait for sockets with io_uring if the kernel has what it takes, or
+  // epoll. Returns false for another name.
+  bool set_engine(const std::string name) {
+    if (name != "uring" && name != "epoll")
+      return false;
+    wantUring = name == "uring";
+    return true;
+  }
+
+  // Answer STATS and Prometheus on port too
+  void set_stats_port(const int port) {
+    if (statsServer.fd)
+      return;
+    statsServer.address.sin_family = AF_INET;
+    statsServer.address.sin_addr.s_addr = INADDR_ANY;
+    statsServer.address.sin_port = htons(port);
+  }
+
+  // Listen on a unix socket at path too. Returns false if it is too long.
+  bool set_socket(const std::string path) {
+    if (localServer.fd || path.size() >= sizeof(localServer.local.sun_path))
+      return false;
+    localServer.local.sun_family = AF_UNIX;
+    strcpy(localServer.local.sun_path, path.c_str());
+    return true;
+  }
+
   ~calcServer() {
     stopServer();
+    if (wakeFd >= 0)
+      ::close(wakeFd);
   }
 
   void startServer() {
-    server.fd = socket(AF_INET, SOCK_STREAM, 0);
+    server.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
     if (server.fd < 0) {
       printf("Error opening socket\n");
       exit(1);
     }
+    const int yes = 1;
+    setsockopt(server.fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    // The kernel spreads the connections over the shards
+    if (sharded)
+      setsockopt(server.fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes));
     if (bind(server.fd, (sockaddr *)&server.address, *server.getLength()) < 0) {
       printf("Unable to bind to that address\n");
       exit(1);
     }
-    server.debug("Server started");
-    listen(server.fd, maxClients);
-    while (true) {
-      if (numberOfConnections < maxClients) {
-        numberOfConnections++;
-        acceptClient();
-      } else {
-        server.debug("Sleeping for 2s");
-        using namespace std::chrono_literals;
-        std::this_thread::sleep_for(2s);
+    // Receive buffers for a few hundred busy clients at a time
+    if (wantUring && not uring.open(256, 512, 4096))
+      server.debug(calcLog::warning, "No io_uring here, using epoll");
+    if (not uring.isOpen())
+      epollFd = epoll_create1(0);
+    if ((epollFd < 0 && not uring.isOpen()) || wakeFd < 0) {
+      printf("Unable to create the event loop\n");
+      exit(1);
+    }
+    server.debug(calcLog::info, "Server started");
+    listen(server.fd, SOMAXCONN);
+    if (localServer.isLocal()) {
+      localServer.fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+      // Left behind by an earlier run
+      unlink(localServer.local.sun_path);
+      if (localServer.fd < 0 ||
+          bind(localServer.fd, (sockaddr *)&localServer.local,
+               *localServer.getLength()) < 0) {
+        printf("Unable to bind to %s\n", localServer.local.sun_path);
+        exit(1);
       }
+      localServer.debug(calcLog::info, "Server started");
+      listen(localServer.fd, SOMAXCONN);
     }
+
+    if (statsServer.address.sin_family == AF_INET) {
+      statsServer.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+      const int yes = 1;
+      setsockopt(statsServer.fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+      if (statsServer.fd < 0 ||
+          bind(statsServer.fd, (sockaddr *)&statsServer.address,
+               *statsServer.getLength()) < 0) {
+        printf("Unable to bind to the stats port\n");
+        exit(1);
+      }
+      statsServer.debug(calcLog::info, "Stats server started");
+      listen(statsServer.fd, SOMAXCONN);
+    }
+
+    uint n = workerCount ? workerCount : std::thread::hardware_concurrency();
+    for (uint i = 0; i < (n ? n : 1) && not sharded; ++i)
+      workers.push_back(startThread(&calcServer::work, this));
+
+    if (uring.isOpen())
+      runUring();
+    else
+      runEpoll();
+    stopServer();
+  }
+
+  // Safe to call from a signal handler
+  void quit() {
+    if (quitting.exchange(true))
+      return;
+    // Wakes the loop of a shard the signal didn't interrupt. The eventfd
+    // lives as long as the server for that.
+    const uint64_t one = 1;
+    if (wakeFd >= 0 && write(wakeFd, &one, sizeof(one)) < 0)
+      return;
   }
 
   void stopServer() {
+    {
+      std::lock_guard<std::mutex> l(jobLock);
+      stopping = true;
+    }
+    jobReady.notify_all();
+    for (std::thread &t : workers)
+      t.join();
+    workers.clear();
+    // Before the replies io_uring may still be sending go
+    uring.close();
+    clients.clear();
+    if (epollFd >= 0)
+      ::close(epollFd);
+    epollFd = -1;
     if (server.fd > 0) {
       server.close();
     }
-  }
-
-  void dropAllClients() {
-    clientHandles.clear();
-  }
-  void acceptClient() {
-    auto client = std::make_shared<IPCdetails>();
-    server.debug("Accepting new clients");
-    client->fd = accept(server.fd, (sockaddr *)&client->address, client->getLength());
-    if (client->fd < 0)
-      server.debug("Can't connect to client");
-    else {
-      client->debug("Welcome");
-      auto address = client->getAddress();
-      client->debug("Registering thread");
-      auto handle = std::async(std::launch::async, &calcServer::runCommands, this, client).share();
-      client->debug("Thread registered");
-      auto old_handle = clientHandles.find(address);
-      if (old_handle != clientHandles.end()) {
-        char c[50];
-        sprintf(c, "Waiting for %s to finish\n", address.c_str());
-        server.debug(c);
-        old_handle->second.wait();
-      }
-      class_mutex.lock();
-      clientHandles.erase(address);
-      clients.erase(address);
-      clients[address] = client;
-      clientHandles[address] = handle;
-      class_mutex.unlock();
-    }
-  }
-  void dropClient(const std::string address) {
-    class_mutex.lock();
-    if (clientHandles.find(address) != clientHandles.end()) {
-      clients.erase(address);
-      numberOfConnections--;
-    } else {
-      printf("Client '%s' didn't connect to this server\n", address.c_str());
+    if (localServer.fd > 0) {
+      unlink(localServer.local.sun_path);
+      localServer.close();
     }
-    class_mutex.unlock();
+    statsServer.close();
   }
 } server;
 
-void stopServer(int sig) {
-  printf("Caught a signal\n");
-  server.stopServer();
-  exit(1);
+// Only server hears of signals. The other shards are stopped by main() once
+// its loop is over, so the handler touches nothing being built meanwhile.
+void stopServer(int) {
+  const int e = errno;
+  server.quit();
+  errno = e;
 }
 
 int main(int argc, char *argv[])
 {
 
-  if (argc < 2) {
+  int opt;
+  ulong shardCount = 1;
+  std::string engine = "epoll";
+  while ((opt = getopt(argc, argv, "u:l:s:m:r:e:c:")) != -1) {
+    if (opt == 'u' && server.set_socket(optarg))
+      continue;
+    if (opt == 'm' && atoi(optarg) > 0) {
+      server.set_stats_port(atoi(optarg));
+      continue;
+    }
+    if (opt == 'l' && (calcLog::find(optarg) != calcLog::off ||
+                       not strcmp(optarg, "off"))) {
+      serverLog.setLevel(calcLog::find(optarg));
+      continue;
+    }
+    if (opt == 's' && atol(optarg) > 0) {
+      serverLog.setSampling(atol(optarg));
+      continue;
+    }
+    if (opt == 'r' && atol(optarg) >= 0) {
+      shardCount = atol(optarg) ? atol(optarg)
+                                : std::thread::hardware_concurrency();
+      shardCount = shardCount ? shardCount : 1;
+      continue;
+    }
+    if (opt == 'e' && server.set_engine(optarg)) {
+      engine = optarg;
+      continue;
+    }
+    if (opt == 'c' && atol(optarg) >= 0) {
+      serverCache.resize(atol(optarg));
+      continue;
+    }
+    fprintf(stderr,
+            "usage: %s [-u <unix socket>] [-m <stats port>] [-l <log level>] "
+            "[-s <n>] [-r <shards>] [-e <engine>] [-c <answers>] <port> "
+            "[workers]\n"
+            "  -m  answer STATS and Prometheus scrapes on another port\n"
+            "  -l  debug, info(default), warning, error or off\n"
+            "  -s  log one in every n debug messages\n"
+            "  -r  run that many loops sharing the port, each answering its\n"
+            "      own connections without workers. 0 runs one per core.\n"
+            "  -e  epoll(default) or uring, which falls back to epoll on\n"
+            "      kernels without it\n"
+            "  -c  answers shared between clients, 65536 by default\n",
+            argv[0]);
+    exit(1);
+  }
+  if (optind >= argc) {
     fprintf(stderr,"ERROR, no port provided\n");
     exit(1);
   }
 
+  // The unix socket and the stats port stay with server
+  std::vector<calcServer *> shards;
+  shards.push_back(&server);
+  std::vector<std::unique_ptr<calcServer>> others;
+  for (ulong i = 1; i < shardCount; ++i) {
+    others.emplace_back(new calcServer);
+    shards.push_back(others.back().get());
+  }
+  for (calcServer *s : shards) {
+    s->set_port(argv[optind]);
+    s->set_engine(engine);
+    if (shardCount > 1)
+      s->set_sharded();
+  }
+
+  // SIGTERM is what kill sends by default. SIGKILL can't be caught.
   signal(SIGINT, stopServer);
-  signal(SIGKILL, stopServer);
+  signal(SIGTERM, stopServer);
   signal(SIGABRT, stopServer);
+  // Clients may go away while anything is written to them
+  signal(SIGPIPE, SIG_IGN);
 
-  makeOperatorHashes();
-
-  server.set_port(argv[1]);
+  serverLog.start();
+  // Optional number of worker threads
+  if (argc > optind + 1)
+    server.set_workers(atoi(argv[optind + 1]));
+  std::vector<std::thread> loops;
+  for (ulong i = 1; i < shardCount; ++i)
+    loops.push_back(
+        calcServer::startThread(&calcServer::startServer, shards[i]));
   server.startServer();
+  for (ulong i = 1; i < shardCount; ++i) {
+    shards[i]->quit();
+    loops[i - 1].join();
+  }
+  serverLog.stop();
+  printf("Caught a signal\n");
 
-  return 0;
+  return 1;
 }
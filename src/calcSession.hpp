@@ -0,0 +1,353 @@
+#ifndef CALC_SESSION_H
+#define CALC_SESSION_H
+
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "calcCache.hpp"
+#include "calcParser.hpp"
+#include "calcStats.hpp"
+
+// What a client of calcServer is talking about: its answers and angle unit,
+// its prepared expressions and the way its requests are answered, whichever
+// way the bytes come in.
+//
+// Requests are lines. A line ends with a newline, which may be preceded by a
+// carriage return, and NULs at its start are skipped so that clients ending
+// each request with "\n\0" still work. Every request gets exactly one reply
+// line, in the order of the requests, so clients may send many requests
+// without waiting for the replies:
+//   1+2*3                    { "ans": 7 }
+//   1/0                      { "error": "Divide Error", "position": 3 }
+//   # a comment              { }
+//   PREPARE f "a*x^2+b*x"    { "prepared": "f", "vars": ["a", "x", "b"] }
+//   EXEC f x=3,a=1,b=2       { "ans": 15 }
+// Answers have the shortest digits reading back as them, and are null for
+// infinity and NaN, which JSON doesn't have. PREPARE compiles an expression
+// once and EXEC runs it with the values bound to its variables, which are kept
+// for later EXECs. Answers of both go into the session's answers. A line saying
+// exit or quit ends the session without a reply.
+//
+// With a calcCache the answers of expressions which don't refer to answers
+// are shared with other sessions. Those still become answers of the session.
+class calcSession {
+public:
+  typedef calcProgram<float64_t> program;
+
+  // Outcome of a request
+  struct result {
+    ERROR e;
+    // Where the error was found if hasPosition is set
+    bool hasPosition;
+    ulong position;
+    // False for comments
+    bool hasAns;
+    float64_t ans;
+  };
+
+private:
+  calcContext<float64_t> context;
+  std::unordered_map<std::string, program> prepared;
+  // Where the requests are measured, if anywhere
+  calcStats *stats = NULL;
+  calcCache *cache = NULL;
+  // Kept for their memory
+  std::string key;
+  program compiled;
+  std::vector<std::pair<ulong, float64_t>> bindings;
+
+  uint64_t begin() const { return this->stats ? calcStats::now() : 0; }
+  void measured(const calcStats::kind k, const uint64_t b, const ERROR e) {
+    if (this->stats)
+      this->stats->record(k, b, e);
+  }
+  void failed(const ERROR e) {
+    if (this->stats)
+      this->stats->countError(e);
+  }
+  static void reply(const result &, std::string &);
+  // Ids are letters, digits and underscores, which JSON takes as they are
+  static bool isId(const std::string &);
+  void prepare(constStr, constStr, std::string &);
+  void exec(constStr, constStr, constStr, std::string &);
+
+public:
+  // Prepared expressions a session may keep
+  static const ulong maxPrepared = 4096;
+
+  void measure(calcStats *s) { this->stats = s; }
+  void share(calcCache *c) { this->cache = c && c->isOn() ? c : NULL; }
+
+  // Answer the complete lines in [start, end) appending the replies to out.
+  // Returns false if one of them ended the session. Lines after it aren't
+  // answered.
+  bool answer(constStr start, constStr end, std::string &out);
+  // Length of the complete lines at the start of [start, end), at most max
+  // bytes of them unless the first line is longer
+  static ulong completeLines(constStr start, constStr end, const ulong max);
+
+  // The requests themselves for transports which don't use lines
+  void evaluate(constStr, constStr, result &);
+  // Compile the expression as id. Returns the program or NULL on errors,
+  // which include ids isId() doesn't take. An id prepared before keeps its
+  // program and its values then, a new one isn't prepared.
+  const program *prepare(const std::string &id, constStr, constStr, result &);
+  // Run id with values bound to its first n variables in the order they
+  // appear in the expression
+  void exec(const std::string &id, const float64_t *, const ulong, result &);
+};
+
+inline void calcSession::reply(const result &r, std::string &out) {
+  char buf[400];
+  if (not r.e.isSet() && not r.hasAns) {
+    out += "{ }";
+    return;
+  }
+  if (not r.e.isSet()) {
+    char n[32];
+    numToStr(r.ans, n);
+    snprintf(buf, sizeof(buf), "{ \"ans\": %s }",
+             std::isfinite(r.ans) ? n : "null");
+  } else if (r.hasPosition) {
+    snprintf(buf, sizeof(buf), "{ \"error\": \"%s\", \"position\": %lu }",
+             r.e.toString(), r.position);
+  } else {
+    snprintf(buf, sizeof(buf), "{ \"error\": \"%s\" }", r.e.toString());
+  }
+  out += buf;
+}
+
+inline bool calcSession::isId(const std::string &id) {
+  for (const char c : id)
+    if (not isalnum((unsigned char)c) && c != '_')
+      return false;
+  return not id.empty();
+}
+
+inline void calcSession::evaluate(constStr start, constStr end, result &r) {
+  const uint64_t b = this->begin();
+  const bool shared =
+      this->cache &&
+      calcCache::key(this->context.angle, start, end, this->key);
+  calcCache::claim claim;
+  if (shared && this->cache->find(this->key, r.ans, claim)) {
+    r.e = this->context.answers.tryPush(r.ans);
+    r.hasPosition = false;
+    r.position = 0;
+    r.hasAns = not r.e.isSet();
+    if (this->stats)
+      this->stats->cached();
+    return this->measured(calcStats::evaluate, b, r.e);
+  }
+  calcParse<float64_t> parser(this->context, start, end - start);
+  r.e = parser.tryParsing();
+  r.hasPosition = r.e.isSet();
+  r.position = parser.errorPosition();
+  r.hasAns = not r.e.isSet() && parser.hasAns();
+  r.ans = parser.Ans();
+  // Errors aren't kept as their position depends on the spaces
+  if (r.hasAns)
+    claim.fill(r.ans);
+  this->measured(calcStats::evaluate, b, r.e);
+}
+
+inline const calcSession::program *
+calcSession::prepare(const std::string &id, constStr start, constStr end,
+                     result &r) {
+  r = result();
+  auto i = this->prepared.find(id);
+  if (i == this->prepared.end() &&
+      (this->prepared.size() >= maxPrepared || not isId(id))) {
+    r.e = ERROR::invalidCmd;
+    this->failed(r.e);
+    return NULL;
+  }
+
+  const uint64_t b = this->begin();
+  calcParse<float64_t> parser(this->context, start, end - start);
+  r.e = parser.tryCompiling(this->compiled);
+  // A comment can't be run
+  if (not r.e.isSet() && not parser.hasAns())
+    r.e = ERROR::parseError;
+  this->measured(calcStats::parse, b, r.e);
+  if (r.e.isSet()) {
+    r.hasPosition = true;
+    r.position = parser.errorPosition();
+    return NULL;
+  }
+  if (i == this->prepared.end())
+    i = this->prepared.emplace(id, program()).first;
+  // The program replaced is compiled over next time
+  std::swap(i->second, this->compiled);
+  return &i->second;
+}
+
+inline void calcSession::exec(const std::string &id, const float64_t *values,
+                              const ulong n, result &r) {
+  r = result();
+  auto i = this->prepared.find(id);
+  if (i == this->prepared.end()) {
+    r.e = ERROR::invalidCmd;
+    this->failed(r.e);
+    return;
+  }
+  const uint64_t b = this->begin();
+  program &p = i->second;
+  for (ulong v = 0; v < n && v < p.varCount(); ++v)
+    p.setVar(v, values[v]);
+  r.e = p.run(r.ans, &this->context.answers);
+  if (not r.e.isSet())
+    r.e = this->context.answers.tryPush(r.ans);
+  this->measured(calcStats::exec, b, r.e);
+  r.hasAns = not r.e.isSet();
+}
+
+// PREPARE <id> <expression> where the expression may be in double quotes
+inline void calcSession::prepare(constStr start, constStr end,
+                                 std::string &out) {
+  result r = result();
+  constStr id = start;
+  while (start < end && not isspace(*start))
+    ++start;
+  const std::string name(id, start - id);
+  while (start < end && isspace(*start))
+    ++start;
+  if (start < end && *start == '"') {
+    ++start;
+    constStr quote = (constStr)memchr(start, '"', end - start);
+    if (quote == NULL)
+      r.e = ERROR::parseError;
+    end = quote;
+  }
+  if (name.empty() || start == end)
+    r.e = ERROR::invalidCmd;
+  if (r.e.isSet())
+    this->failed(r.e);
+  const program *p = r.e.isSet() ? NULL : this->prepare(name, start, end, r);
+  if (p == NULL)
+    return reply(r, out);
+
+  out += "{ \"prepared\": \"";
+  out += name;
+  out += "\", \"vars\": [";
+  for (ulong v = 0; v < p->varCount(); ++v) {
+    out += v ? ", \"" : "\"";
+    out += p->varName(v);
+    out += '"';
+  }
+  out += "] }";
+}
+
+// EXEC <id> <name>=<number>,... with any of the bindings left out. Errors in
+// the bindings are reported at their position in line, with none of them
+// bound.
+inline void calcSession::exec(constStr line, constStr start, constStr end,
+                              std::string &out) {
+  result r = result();
+  constStr id = start;
+  while (start < end && not isspace(*start))
+    ++start;
+  const std::string name(id, start - id);
+  auto i = this->prepared.find(name);
+  if (i == this->prepared.end()) {
+    r.e = ERROR::invalidCmd;
+    this->failed(r.e);
+    return reply(r, out);
+  }
+  program &p = i->second;
+
+  this->bindings.clear();
+  while (start < end) {
+    while (start < end && (isspace(*start) || *start == ','))
+      ++start;
+    if (start == end)
+      break;
+    constStr var = start;
+    while (start < end && (isalpha(*start) || *start == '_'))
+      ++start;
+    const slong v = p.varIndex(var, start - var);
+    while (start < end && isspace(*start))
+      ++start;
+    r.hasPosition = true;
+    if (v < 0 || start == end || *start != '=') {
+      r.e = ERROR::varUndef;
+      r.position = var - line;
+      this->failed(r.e);
+      return reply(r, out);
+    }
+    ++start;
+    while (start < end && isspace(*start))
+      ++start;
+    float64_t x;
+    r.position = start - line;
+    if (not strToNum(&start, end, x, REAL)) {
+      r.e = ERROR::parseError;
+      this->failed(r.e);
+      return reply(r, out);
+    }
+    this->bindings.push_back(std::make_pair(v, x));
+  }
+
+  for (const auto &b : this->bindings)
+    p.setVar(b.first, b.second);
+  this->exec(name, NULL, 0, r);
+  reply(r, out);
+}
+
+inline bool calcSession::answer(constStr start, constStr end,
+                                std::string &out) {
+  while (start < end) {
+    constStr nl = (constStr)memchr(start, '\n', end - start);
+    if (nl == NULL)
+      break;
+    constStr b = start, e = nl;
+    start = nl + 1;
+    while (b < e && *b == '\0')
+      ++b;
+    if (e > b && e[-1] == '\r')
+      --e;
+    if ((e - b == 4 && not memcmp(b, "exit", 4)) ||
+        (e - b == 4 && not memcmp(b, "quit", 4)))
+      return false;
+    constStr c = b;
+    while (c < e && isspace(*c))
+      ++c;
+    if (c == e) {
+      out += "{ }";
+    } else if (e - c > 8 && not memcmp(c, "PREPARE ", 8)) {
+      this->prepare(c + 8, e, out);
+    } else if (e - c > 5 && not memcmp(c, "EXEC ", 5)) {
+      this->exec(b, c + 5, e, out);
+    } else {
+      result r;
+      this->evaluate(b, e, r);
+      reply(r, out);
+    }
+    out += '\n';
+  }
+  return true;
+}
+
+inline ulong calcSession::completeLines(constStr start, constStr end,
+                                        const ulong max) {
+  const ulong len = end - start;
+  const void *nl = memrchr(start, '\n', len < max ? len : max);
+  if (nl == NULL)
+    nl = memchr(start, '\n', len);
+  return nl ? (constStr)nl + 1 - start : 0;
+}
+
+#endif
+
+/*
+  Local Variables:
+  mode: c++
+  c-file-offset: 2
+  fill-column: 80
+  End:
+*/
@@ -4,16 +4,57 @@
 #include "calcError.hpp"
 #include <algorithm>
 #include <iostream>
+#include <limits.h>
+#include <stdlib.h>
 #include <string>
+#include <type_traits>
+#include <utility>
+
+// A stack which holds its first inlineSize elements inside itself, so that
+// stacks of typical expressions never allocate. Beyond that the elements move
+// to the heap, which grows rate times(or by rate elements if it isn't fast)
+// every time it is full. Trivially copyable elements grow with realloc(),
+// which moves large blocks by remapping them instead of copying. Pushes which
+// can't grow the stack return false instead of throwing. Constructors and
+// copies which can't allocate throw std::bad_alloc like new does. A size of 0
+// keeps to the inline elements and rates below 2 count as 2.
+template <typename Type, ulong inlineSize = 16> class calcStack {
+  static const bool trivial = std::is_trivially_copyable<Type>::value;
 
-template <typename Type> class calcStack {
   Type *start;
-  Type *current;
+  // Number of elements
+  ulong count;
   ulong size;
   ulong rate;
   bool accelerate;
-  void increaseSize();
-  bool decreaseSize();
+  Type local[inlineSize];
+
+  bool isLocal() const { return this->start == this->local; }
+  bool increaseSize(const ulong);
+  void moveTo(Type *, const ulong);
+  bool resize(const ulong);
+  static Type *allocate(const ulong n) {
+    if (not trivial)
+      return new Type[n];
+    Type *t = (Type *)malloc(n * sizeof(Type));
+    if (t == NULL)
+      throw std::bad_alloc();
+    return t;
+  }
+  static Type *reallocate(Type *, const ulong, std::false_type) {
+    return NULL;
+  }
+  static Type *reallocate(Type *s, const ulong n, std::true_type) {
+    return (Type *)realloc((void *)s, n * sizeof(Type));
+  }
+  void release() {
+    if (this->isLocal())
+      return;
+    if (trivial)
+      free(this->start);
+    else
+      delete[] this->start;
+  }
 
 public:
   calcStack();
@@ -21,253 +62,244 @@ public:
   explicit calcStack(const bool);
   calcStack(const ulong, const ulong, const bool);
   calcStack(const calcStack &);
-  calcStack(calcStack &&);
+  calcStack(calcStack &&) noexcept;
   ~calcStack();
   ulong totalElements() const;
   ulong capacity() const;
   bool setCapacity(const ulong);
   bool isEmpty() const;
   void beFast(const bool);
-  void operator=(const calcStack &);
+  calcStack &operator=(const calcStack &);
+  calcStack &operator=(calcStack &&) noexcept;
   bool find(const ulong, Type &) const;
   bool get(Type &) const;
   bool pop();
   bool pop(Type &);
-  void push(const Type);
-  void push(const Type *, const Type *);
+  bool push(const Type);
+  bool push(const Type *, const Type *);
   void reset();
   __attribute__((noinline)) void display(std::string before = "",
                                          std::string after = "") const;
 };
 
-template <typename Type> calcStack<Type>::calcStack() {
-  this->size = 16;
-  this->rate = 2;
-  this->accelerate = 1;
-  this->start = new Type[this->size];
-  this->current = 0;
-}
+template <typename Type, ulong inlineSize>
+calcStack<Type, inlineSize>::calcStack()
+    : start(local), count(0), size(inlineSize), rate(2), accelerate(true) {}
 
-template <typename Type> calcStack<Type>::calcStack(const ulong size) {
-  if (not size)
-    error(sizeError);
-  this->size = size;
-  this->rate = 2;
-  this->accelerate = 1;
-  this->start = new Type[this->size];
-  this->current = 0;
+template <typename Type, ulong inlineSize>
+calcStack<Type, inlineSize>::calcStack(const ulong size) : calcStack() {
+  if (size && not this->setCapacity(size))
+    throw std::bad_alloc();
 }
 
-template <typename Type> calcStack<Type>::calcStack(const bool accelerate) {
-  this->size = 16;
-  this->rate = 2;
+template <typename Type, ulong inlineSize>
+calcStack<Type, inlineSize>::calcStack(const bool accelerate) : calcStack() {
   this->accelerate = accelerate;
-  this->start = new Type[this->size];
-  this->current = 0;
 }
 
-template <typename Type>
-calcStack<Type>::calcStack(const ulong size, const ulong rate,
-                           const bool accelerate) {
-  if (not size || rate < 2)
-    error(sizeError);
-  this->size = size;
-  this->rate = rate;
+template <typename Type, ulong inlineSize>
+calcStack<Type, inlineSize>::calcStack(const ulong size, const ulong rate,
+                                       const bool accelerate)
+    : calcStack() {
+  this->rate = std::max(rate, 2UL);
   this->accelerate = accelerate;
-  this->start = new Type[this->size];
-  this->current = 0;
+  if (size && not this->setCapacity(size))
+    throw std::bad_alloc();
 }
 
-template <typename Type> calcStack<Type>::calcStack(const calcStack<Type> &t) {
-  this->size = t.size;
+template <typename Type, ulong inlineSize>
+calcStack<Type, inlineSize>::calcStack(const calcStack &t) : calcStack() {
+  *this = t;
+}
+
+template <typename Type, ulong inlineSize>
+calcStack<Type, inlineSize>::calcStack(calcStack &&t) noexcept
+    : calcStack() {
+  *this = std::move(t);
+}
+
+template <typename Type, ulong inlineSize>
+calcStack<Type, inlineSize>::~calcStack() {
+  this->release();
+}
+
+template <typename Type, ulong inlineSize>
+calcStack<Type, inlineSize> &calcStack<Type, inlineSize>::
+operator=(const calcStack &t) {
+  if (this == &t)
+    return *this;
   this->rate = t.rate;
   this->accelerate = t.accelerate;
-  this->start = new Type[this->size];
-  this->current = t.current ? this->start + (t.current - t.start) : 0;
-  std::copy(t.start, t.current, this->start);
+  this->count = 0;
+  if (this->size < t.count && not this->setCapacity(t.count))
+    throw std::bad_alloc();
+  std::copy(t.start, t.start + t.count, this->start);
+  this->count = t.count;
+  return *this;
 }
 
-template <typename Type> calcStack<Type>::calcStack(calcStack<Type>&& t) :
-  size(t.size), rate(t.rate), accelerate(t.accelarate), start(t.start),
-  current(t.current)
-{
-  t.size = 16;
-  t.rate = 2;
-  t.accelerate = 1;
-  t.start = new Type[t.size];
-  t.current = 0;
+template <typename Type, ulong inlineSize>
+calcStack<Type, inlineSize> &calcStack<Type, inlineSize>::
+operator=(calcStack &&t) noexcept {
+  if (this == &t)
+    return *this;
+  this->release();
+  this->rate = t.rate;
+  this->accelerate = t.accelerate;
+  this->count = t.count;
+  this->size = t.size;
+  if (t.isLocal()) {
+    // Only the inline elements have to be copied
+    this->start = this->local;
+    std::move(t.start, t.start + t.count, this->local);
+  } else {
+    this->start = t.start;
+  }
+  t.start = t.local;
+  t.size = inlineSize;
+  t.count = 0;
+  return *this;
 }
 
-template <typename Type> ulong calcStack<Type>::totalElements() const {
-  return this->current ? this->current - this->start : 0;
+template <typename Type, ulong inlineSize>
+ulong calcStack<Type, inlineSize>::totalElements() const {
+  return this->count;
 }
 
-template <typename Type> ulong calcStack<Type>::capacity() const {
+template <typename Type, ulong inlineSize>
+ulong calcStack<Type, inlineSize>::capacity() const {
   return this->size;
 }
 
-template <typename Type> bool calcStack<Type>::setCapacity(const ulong s) {
-  if (not s)
-    error(sizeError);
+// Move the elements to s, which holds n of them. Extra elements are dropped.
+template <typename Type, ulong inlineSize>
+void calcStack<Type, inlineSize>::moveTo(Type *s, const ulong n) {
+  this->count = std::min(this->count, n);
+  std::move(this->start, this->start + this->count, s);
+  this->release();
+  this->start = s;
+  this->size = n;
+}
+
+// Move the elements to a heap block holding n of them. False if there is no
+// memory for it, with the elements left where they were.
+template <typename Type, ulong inlineSize>
+bool calcStack<Type, inlineSize>::resize(const ulong n) {
   try {
-    Type *temp = new Type[s];
-    size = s;
-    if (current) {
-      std::copy(start, current, temp);
-      current = temp + (s > (ulong)(current - start) ? current - start : s);
+    if (not trivial || this->isLocal()) {
+      this->moveTo(allocate(n), n);
+      return 1;
     }
-    delete[] this->start;
-    start = temp;
+    Type *t = reallocate(this->start, n,
+                         std::integral_constant<bool, trivial>());
+    if (t == NULL)
+      return 0;
+    this->start = t;
+    this->size = n;
+    this->count = std::min(this->count, n);
     return 1;
   } catch (const std::bad_alloc &x) {
-    error(memAlloc);
+    return 0;
   }
 }
 
-template <typename Type> bool calcStack<Type>::isEmpty() const {
-  return !current;
-}
-
-template <typename Type>
-bool calcStack<Type>::find(const ulong pos, Type &x) const {
-  if (current)
-    if (pos)
-      return pos <= (ulong)(current - start) ? (x = start[pos - 1], 1) : 0;
-    else
-      return x = *(current - 1), 1;
-  else
+template <typename Type, ulong inlineSize>
+bool calcStack<Type, inlineSize>::setCapacity(const ulong s) {
+  if (not s)
     return 0;
+  if (s <= inlineSize) {
+    this->count = std::min(this->count, s);
+    if (not this->isLocal())
+      this->moveTo(this->local, inlineSize);
+    return 1;
+  }
+  return this->resize(s);
 }
 
-template <typename Type>
-void calcStack<Type>::operator=(const calcStack<Type> &t) {
-  if (this->start)
-    delete[] this->start;
-  this->start = new Type[this->size = t.size];
-  this->rate = t.rate;
-  this->accelerate = t.accelerate;
-  this->current = t.current ? this->start + (t.current - t.start) : 0;
-  std::copy(t.start, t.current, this->start);
+template <typename Type, ulong inlineSize>
+bool calcStack<Type, inlineSize>::isEmpty() const {
+  return !this->count;
 }
 
-template <typename Type> calcStack<Type>::~calcStack() {
-  this->reset();
-  delete[] this->start;
+template <typename Type, ulong inlineSize>
+bool calcStack<Type, inlineSize>::find(const ulong pos, Type &x) const {
+  if (not this->count)
+    return 0;
+  if (not pos)
+    return x = this->start[this->count - 1], 1;
+  return pos <= this->count ? (x = this->start[pos - 1], 1) : 0;
 }
 
-template <typename Type> void calcStack<Type>::beFast(const bool acc) {
+template <typename Type, ulong inlineSize>
+void calcStack<Type, inlineSize>::beFast(const bool acc) {
   this->accelerate = acc;
 }
 
-template <typename Type> bool calcStack<Type>::pop(Type &y) {
-  if (current) {
-    y = *(--current);
-    current = start == current ? 0 : current;
-    return 1;
-  }
-  return 0;
+template <typename Type, ulong inlineSize>
+bool calcStack<Type, inlineSize>::pop(Type &y) {
+  if (not this->count)
+    return 0;
+  y = this->start[--this->count];
+  return 1;
 }
 
-template <typename Type> bool calcStack<Type>::pop() {
-  if (this->current) {
-    if (this->start == --this->current)
-      this->current = 0;
-    return 1;
-  }
-  return 0;
+template <typename Type, ulong inlineSize>
+bool calcStack<Type, inlineSize>::pop() {
+  if (not this->count)
+    return 0;
+  --this->count;
+  return 1;
 }
 
-template <typename Type> bool calcStack<Type>::get(Type &y) const {
-  return current ? (y = *(current - 1), 1) : 0;
+template <typename Type, ulong inlineSize>
+bool calcStack<Type, inlineSize>::get(Type &y) const {
+  return this->count ? (y = this->start[this->count - 1], 1) : 0;
 }
 
-template <typename Type> void calcStack<Type>::push(const Type y) {
-  if (current) {
-    if ((ulong)(current - start) == size)
-      this->increaseSize();
-    *current = y;
-  } else
-    *(current = start) = y;
-  ++current;
+template <typename Type, ulong inlineSize>
+bool calcStack<Type, inlineSize>::push(const Type y) {
+  if (this->count == this->size && not this->increaseSize(this->count + 1))
+    return 0;
+  this->start[this->count++] = y;
+  return 1;
 }
 
-template <typename Type>
-void calcStack<Type>::push(const Type *start, const Type *end) {
-  while (this->size < end - start)
-    this->increaseSize();
-  if (this->current) {
-    std::copy(start, end, this->current - 1);
-    this->current += end - start;
-  } else {
-    std::copy(start, end, this->start);
-    this->current = this->start + (end - start);
-  }
+template <typename Type, ulong inlineSize>
+bool calcStack<Type, inlineSize>::push(const Type *s, const Type *e) {
+  const ulong n = e - s;
+  if (this->count + n > this->size && not this->increaseSize(this->count + n))
+    return 0;
+  std::copy(s, e, this->start + this->count);
+  this->count += n;
+  return 1;
 }
 
-template <typename Type> void calcStack<Type>::reset() { current = 0; }
-
-template <typename Type> bool calcStack<Type>::decreaseSize() {
-  try {
-    ulong count = current ? current - start : 0;
-    ulong s;
-    if (accelerate) {
-      if (rate < 3 || size / rate == 0)
-        return 0;
-      else if (size / rate < count)
-        s = count;
-      else
-        s = size / rate, --rate;
-    } else {
-      if (size <= rate)
-        return 0;
-      else if (size - rate < count)
-        s = count;
-      else
-        s = size - rate;
-    }
-    Type *temp = new Type[s];
-    size = s;
-    if (current) {
-      std::copy(this->start, this->start + size, temp);
-      current = temp + count;
-    }
-    delete[] this->start;
-    this->start = temp;
-    return 1;
-  } catch (const std::bad_alloc &x) {
-    accelerate ? ++rate : 0;
-    error(memAlloc);
-  }
+template <typename Type, ulong inlineSize>
+void calcStack<Type, inlineSize>::reset() {
+  this->count = 0;
 }
 
-template <typename Type> void calcStack<Type>::increaseSize() {
-  try {
-    if (accelerate ?
-        (rate + 1 < rate ||
-         size * (rate + 1) < size) :
-        (size + rate < size))
-      error(sizeError);
-    Type *temp = new Type[accelerate ? (rate + 1) * size : rate + size];
-    size = accelerate ? size * (++rate) : size + rate;
-    if (current) {
-      std::copy(this->start, current, temp);
-      current = temp + (current - this->start);
-    }
-    delete[] this->start;
-    this->start = temp;
-  } catch (const std::bad_alloc &x) {
-    error(memAlloc);
+// Grow until at least n elements fit. False if the size overflows or there is
+// no memory.
+template <typename Type, ulong inlineSize>
+bool calcStack<Type, inlineSize>::increaseSize(const ulong n) {
+  ulong s = this->size;
+  while (s < n) {
+    const ulong next = this->accelerate ? s * this->rate : s + this->rate;
+    if (next <= s || next > ULONG_MAX / sizeof(Type))
+      return 0;
+    s = next;
   }
+  return this->resize(s);
 }
 
-template <typename Type>
-void calcStack<Type>::display(const std::string before,
-                              const std::string after) const {
-  if (this->current)
-    for (Type *t = this->start; t < this->current; ++t)
-      std::cout << before << *t << after;
+template <typename Type, ulong inlineSize>
+void calcStack<Type, inlineSize>::display(const std::string before,
+                                          const std::string after) const {
+  for (ulong i = 0; i < this->count; ++i)
+    std::cout << before << this->start[i] << after;
 #ifdef DEBUG
-  else
+  if (not this->count)
     std::cerr << "Error: Stack is empty" << std::endl
               << "Array Address: " << this->start << std::endl
               << "At '" << __FILE__ << "' on " << __LINE__ << std::endl;
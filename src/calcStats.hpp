@@ -0,0 +1,345 @@
+#ifndef CALC_STATS_H
+#define CALC_STATS_H
+
+#include <atomic>
+#include <mutex>
+#include <stdio.h>
+#include <string>
+#include <time.h>
+
+#include "calcError.hpp"
+#include "calcPerThread.hpp"
+
+// Latencies in nanoseconds, HDR style: a value goes to the bucket of its
+// highest bit and the subBits bits below it, so that every bucket is within
+// 1/2^subBits of the values in it from a nanosecond up. Only one thread writes
+// a histogram while others may read it.
+class latencyHistogram {
+  static const uint subBits = 4;
+  static const uint sub = 1 << subBits;
+
+public:
+  static const uint buckets = (64 - subBits + 1) * sub;
+
+private:
+  std::atomic<uint64_t> counts[buckets];
+  std::atomic<uint64_t> total;
+  std::atomic<uint64_t> sum;
+  std::atomic<uint64_t> max;
+
+  static void add(std::atomic<uint64_t> &a, const uint64_t n) {
+    a.store(a.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+  }
+
+public:
+  latencyHistogram() {
+    for (auto &c : this->counts)
+      c.store(0, std::memory_order_relaxed);
+    this->total.store(0, std::memory_order_relaxed);
+    this->sum.store(0, std::memory_order_relaxed);
+    this->max.store(0, std::memory_order_relaxed);
+  }
+
+  static uint bucket(const uint64_t ns) {
+    if (ns < sub)
+      return ns;
+    const uint shift = 63 - __builtin_clzll(ns) - subBits;
+    return (shift + 1) * sub + ((ns >> shift) & (sub - 1));
+  }
+  // Largest value in bucket b
+  static uint64_t upper(const uint b) {
+    if (b < sub)
+      return b;
+    const uint shift = b / sub - 1;
+    return ((uint64_t)(b % sub + sub + 1) << shift) - 1;
+  }
+
+  void record(const uint64_t ns) {
+    add(this->counts[bucket(ns)], 1);
+    add(this->total, 1);
+    add(this->sum, ns);
+    if (ns > this->max.load(std::memory_order_relaxed))
+      this->max.store(ns, std::memory_order_relaxed);
+  }
+  // Add the values of h, which its thread may still be writing
+  void merge(const latencyHistogram &h) {
+    for (uint b = 0; b < buckets; ++b)
+      add(this->counts[b], h.count(b));
+    add(this->total, h.count());
+    add(this->sum, h.nanoseconds());
+    if (h.largest() > this->largest())
+      this->max.store(h.largest(), std::memory_order_relaxed);
+  }
+
+  uint64_t count(const uint b) const {
+    return this->counts[b].load(std::memory_order_relaxed);
+  }
+  uint64_t count() const { return this->total.load(std::memory_order_relaxed); }
+  uint64_t nanoseconds() const {
+    return this->sum.load(std::memory_order_relaxed);
+  }
+  uint64_t largest() const { return this->max.load(std::memory_order_relaxed); }
+  // The value q of the way through, to within a bucket
+  uint64_t quantile(const double q) const;
+};
+
+inline uint64_t latencyHistogram::quantile(const double q) const {
+  const uint64_t n = this->count();
+  if (n == 0)
+    return 0;
+  const uint64_t rank = q * n < 1 ? 1 : (uint64_t)(q * n + 0.5);
+  uint64_t seen = 0;
+  for (uint b = 0; b < buckets; ++b) {
+    seen += this->count(b);
+    if (seen >= rank)
+      return upper(b) < this->largest() ? upper(b) : this->largest();
+  }
+  return this->largest();
+}
+
+// What calcServer measures. Every thread records into histograms of its own
+// and a reading adds them up, so recording costs a few relaxed stores.
+//   evaluate  expressions, which are parsed and evaluated in one go
+//   parse     expressions compiled by PREPARE
+//   exec      prepared expressions run by EXEC
+//   job       lines from being handed to the workers to their replies coming
+//             back, waiting for a worker included
+// Requests are those of the first three. Errors are counted by code,
+// connections by the threads which accepted them and expressions answered
+// from the calcCache too.
+class calcStats {
+public:
+  enum kind { evaluate, parse, exec, job, kinds };
+  // Values of the server at the time of reading
+  struct gauges {
+    ulong queue;
+  };
+
+private:
+  static const uint errorCodes = 32;
+
+  struct shard {
+    latencyHistogram latency[kinds];
+    std::atomic<uint64_t> errors[errorCodes];
+    std::atomic<slong> connections{0};
+    std::atomic<slong> channels{0};
+    std::atomic<uint64_t> hits{0};
+    shard() {
+      for (auto &e : this->errors)
+        e.store(0, std::memory_order_relaxed);
+    }
+  };
+
+  // The shards added up
+  struct summary {
+    latencyHistogram latency[kinds];
+    uint64_t errors[errorCodes] = {};
+    uint64_t requests = 0;
+    slong connections = 0;
+    slong channels = 0;
+    uint64_t hits = 0;
+  };
+
+  calcPerThread<shard> shards;
+  const uint64_t started;
+  // For the rate since the last reading
+  std::mutex lastLock;
+  uint64_t lastTime;
+  uint64_t lastRequests = 0;
+
+  void read(summary &);
+  double rate(const summary &);
+  static void add(std::atomic<slong> &a, const slong n) {
+    a.store(a.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+  }
+
+public:
+  static constStr name(const kind);
+
+  calcStats() : started(now()), lastTime(started) {}
+
+  // Monotonic nanoseconds
+  static uint64_t now() {
+    timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000ULL + t.tv_nsec;
+  }
+
+  // A request of kind which started at begin and failed with e if it is set
+  void record(const kind k, const uint64_t begin, const ERROR e) {
+    this->shards.mine().latency[k].record(now() - begin);
+    if (e.isSet())
+      this->countError(e);
+  }
+  // An error found before anything was measured
+  void countError(const ERROR e) {
+    std::atomic<uint64_t> &c =
+        this->shards.mine().errors[(uint)-e.code() % errorCodes];
+    c.store(c.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  }
+
+  // Clients connected, of which channels talk through shared memory
+  void connected(const slong n) { add(this->shards.mine().connections, n); }
+  void attached(const slong n) { add(this->shards.mine().channels, n); }
+  // An expression answered from the cache
+  void cached() {
+    std::atomic<uint64_t> &h = this->shards.mine().hits;
+    h.store(h.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  }
+
+  // Prometheus text exposition
+  std::string prometheus(const gauges &);
+  // A line of JSON with the quantiles in nanoseconds
+  std::string json(const gauges &);
+};
+
+inline constStr calcStats::name(const kind k) {
+  static constStr names[] = {"evaluate", "parse", "exec", "job"};
+  return names[k];
+}
+
+inline void calcStats::read(summary &sum) {
+  this->shards.each([&sum](shard &s, const uint) {
+    for (uint k = 0; k < kinds; ++k)
+      sum.latency[k].merge(s.latency[k]);
+    for (uint e = 0; e < errorCodes; ++e)
+      sum.errors[e] += s.errors[e].load(std::memory_order_relaxed);
+    sum.connections += s.connections.load(std::memory_order_relaxed);
+    sum.channels += s.channels.load(std::memory_order_relaxed);
+    sum.hits += s.hits.load(std::memory_order_relaxed);
+  });
+  for (uint k = evaluate; k <= exec; ++k)
+    sum.requests += sum.latency[k].count();
+}
+
+// Requests per second since the last reading
+inline double calcStats::rate(const summary &sum) {
+  std::lock_guard<std::mutex> l(this->lastLock);
+  const uint64_t t = now();
+  const double r = t > this->lastTime ? (sum.requests - this->lastRequests) *
+                                            1e9 / (t - this->lastTime)
+                                      : 0;
+  this->lastTime = t;
+  this->lastRequests = sum.requests;
+  return r;
+}
+
+inline std::string calcStats::prometheus(const gauges &g) {
+  // Bucket bounds in nanoseconds
+  static const uint64_t bounds[] = {
+      500,     1000,     2000,     5000,      10000,     20000,
+      50000,   100000,   200000,   500000,    1000000,   2000000,
+      5000000, 10000000, 50000000, 100000000, 1000000000};
+  std::unique_ptr<summary> sum(new summary);
+  this->read(*sum);
+  std::string out;
+  char buf[256];
+  auto line = [&out, &buf](const int n) {
+    if (n > 0)
+      out.append(buf, (ulong)n < sizeof(buf) ? n : sizeof(buf) - 1);
+  };
+
+  out += "# HELP calc_uptime_seconds Seconds since the server started.\n"
+         "# TYPE calc_uptime_seconds gauge\n";
+  line(snprintf(buf, sizeof(buf), "calc_uptime_seconds %.3f\n",
+                (now() - this->started) / 1e9));
+  out += "# HELP calc_requests_total Requests answered.\n"
+         "# TYPE calc_requests_total counter\n";
+  line(snprintf(buf, sizeof(buf), "calc_requests_total %lu\n",
+                (ulong)sum->requests));
+  out += "# HELP calc_cache_hits_total Expressions answered from the cache.\n"
+         "# TYPE calc_cache_hits_total counter\n";
+  line(snprintf(buf, sizeof(buf), "calc_cache_hits_total %lu\n",
+                (ulong)sum->hits));
+  out += "# HELP calc_errors_total Requests answered with an error.\n"
+         "# TYPE calc_errors_total counter\n";
+  for (uint e = 1; e < errorCodes; ++e)
+    if (sum->errors[e])
+      line(snprintf(buf, sizeof(buf), "calc_errors_total{error=\"%s\"} %lu\n",
+                    ERROR(-(schar)e).toString(), (ulong)sum->errors[e]));
+  out += "# HELP calc_connections Clients connected.\n"
+         "# TYPE calc_connections gauge\n";
+  line(snprintf(buf, sizeof(buf),
+                "calc_connections{transport=\"socket\"} %lu\n"
+                "calc_connections{transport=\"shm\"} %lu\n",
+                (ulong)(sum->connections - sum->channels),
+                (ulong)sum->channels));
+  out += "# HELP calc_queue_depth Jobs waiting for a worker.\n"
+         "# TYPE calc_queue_depth gauge\n";
+  line(snprintf(buf, sizeof(buf), "calc_queue_depth %lu\n", g.queue));
+
+  for (uint k = 0; k < kinds; ++k) {
+    const latencyHistogram &h = sum->latency[k];
+    constStr n = name((kind)k);
+    line(snprintf(buf, sizeof(buf),
+                  "# HELP calc_%s_seconds Latency of %s.\n"
+                  "# TYPE calc_%s_seconds histogram\n",
+                  n, n, n));
+    uint b = 0;
+    uint64_t below = 0;
+    for (const uint64_t bound : bounds) {
+      for (; b < latencyHistogram::buckets &&
+             latencyHistogram::upper(b) <= bound;
+           ++b)
+        below += h.count(b);
+      line(snprintf(buf, sizeof(buf), "calc_%s_seconds_bucket{le=\"%g\"} %lu\n",
+                    n, bound / 1e9, (ulong)below));
+    }
+    line(snprintf(buf, sizeof(buf),
+                  "calc_%s_seconds_bucket{le=\"+Inf\"} %lu\n"
+                  "calc_%s_seconds_sum %.9f\n"
+                  "calc_%s_seconds_count %lu\n",
+                  n, (ulong)h.count(), n, h.nanoseconds() / 1e9, n,
+                  (ulong)h.count()));
+  }
+  return out;
+}
+
+inline std::string calcStats::json(const gauges &g) {
+  std::unique_ptr<summary> sum(new summary);
+  this->read(*sum);
+  std::string out;
+  char buf[256];
+  auto line = [&out, &buf](const int n) {
+    if (n > 0)
+      out.append(buf, (ulong)n < sizeof(buf) ? n : sizeof(buf) - 1);
+  };
+
+  line(snprintf(buf, sizeof(buf),
+                "{ \"uptime\": %.3f, \"requests\": %lu, "
+                "\"requests_per_second\": %.1f, \"cache_hits\": %lu, "
+                "\"connections\": %lu, \"shm\": %lu, \"queue\": %lu, "
+                "\"errors\": {",
+                (now() - this->started) / 1e9, (ulong)sum->requests,
+                this->rate(*sum), (ulong)sum->hits, (ulong)sum->connections,
+                (ulong)sum->channels, g.queue));
+  bool first = true;
+  for (uint e = 1; e < errorCodes; ++e)
+    if (sum->errors[e]) {
+      line(snprintf(buf, sizeof(buf), "%s\"%s\": %lu", first ? " " : ", ",
+                    ERROR(-(schar)e).toString(), (ulong)sum->errors[e]));
+      first = false;
+    }
+  out += first ? "}" : " }";
+  for (uint k = 0; k < kinds; ++k) {
+    const latencyHistogram &h = sum->latency[k];
+    line(snprintf(buf, sizeof(buf),
+                  ", \"%s\": { \"count\": %lu, \"p50\": %lu, \"p90\": %lu, "
+                  "\"p99\": %lu, \"p999\": %lu, \"max\": %lu }",
+                  name((kind)k), (ulong)h.count(), (ulong)h.quantile(0.5),
+                  (ulong)h.quantile(0.9), (ulong)h.quantile(0.99),
+                  (ulong)h.quantile(0.999), (ulong)h.largest()));
+  }
+  out += " }\n";
+  return out;
+}
+
+#endif
+
+/*
+  Local Variables:
+  mode: c++
+  c-file-offset: 2
+  fill-column: 80
+  End:
+*/
@@ -0,0 +1,337 @@
+#ifndef CALC_URING_H
+#define CALC_URING_H
+
+#include <atomic>
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "common.hpp"
+
+// An io_uring driven through its system calls, with no liburing. Requests are
+// queued with the functions below and go to the kernel together, with the
+// wait for their completions, in a single submit(). Completions carry the
+// data given with their request.
+//
+// Receives take their memory from a ring of buffers given to the kernel up
+// front, so a connection waiting for data holds none. The buffer of a
+// completion goes back with recycle() once its bytes are copied.
+class calcUring {
+  int fd;
+  // Submission queue
+  void *sqMemory;
+  ulong sqBytes;
+  std::atomic<uint32_t> *sqHead, *sqTail;
+  uint32_t sqMask;
+  uint32_t *sqArray;
+  io_uring_sqe *sqes;
+  ulong sqesBytes;
+  // Queued since the last submit()
+  uint32_t queued;
+  // errno of the first request which found no room, filled in spare
+  int failure;
+  io_uring_sqe spare;
+  // Completion queue, in the same memory
+  std::atomic<uint32_t> *cqHead, *cqTail;
+  uint32_t cqMask;
+  io_uring_cqe *cqes;
+  // Provided buffers. Not an io_uring_buf_ring, whose flexible array C++
+  // puts after an empty struct taking a byte.
+  io_uring_buf *buffers;
+  ulong buffersBytes;
+  char *bufferMemory;
+  uint16_t bufferCount;
+  uint32_t bufferSize;
+  uint16_t bufferTail;
+
+  static int enter(const int fd, const uint submit, const uint wait,
+                   const uint flags) {
+    return syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+  }
+  io_uring_sqe *next();
+
+public:
+  // Buffer group of the provided buffers
+  static const uint16_t group = 0;
+
+  calcUring()
+      : fd(-1), sqMemory(MAP_FAILED), buffers(NULL), bufferMemory(NULL) {}
+  calcUring(const calcUring &) = delete;
+  calcUring &operator=(const calcUring &) = delete;
+  ~calcUring() { this->close(); }
+
+  // A ring for entries requests at a time, with count buffers of size bytes
+  // for receiving, count a power of 2. False if the kernel can't do all that
+  // is needed.
+  bool open(const uint entries, const uint16_t count, const uint32_t size);
+  void close();
+  bool isOpen() const { return this->fd >= 0; }
+
+  // The requests. Multishot ones complete many times, with IORING_CQE_F_MORE
+  // set on all completions but their last.
+  void accept(const int listener, const uint64_t data);
+  void receive(const int socket, const uint64_t data);
+  void poll(const int fd, const uint32_t events, const uint64_t data);
+  // m and what it points to stay put until the completion
+  void send(const int socket, const msghdr *m, const uint64_t data);
+  // Make the request queued with data complete soon, with -ECANCELED if it
+  // hadn't already
+  void cancel(const uint64_t data);
+  // Complete with -ETIME after t, which stays put until submitted
+  void timeout(const __kernel_timespec *t, const uint64_t data);
+
+  // Give the queued requests to the kernel and wait for a completion if
+  // there is none. False, with errno set, on errors other than a signal,
+  // those of a request queued when the kernel took none to make room too.
+  bool submit();
+  // f(completion) for all there are
+  template <typename F> void each(F f);
+
+  char *buffer(const uint16_t id) const {
+    return this->bufferMemory + (ulong)id * this->bufferSize;
+  }
+  void recycle(const uint16_t id);
+};
+
+inline bool calcUring::open(const uint entries, const uint16_t count,
+                            const uint32_t size) {
+  this->close();
+  io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  this->fd = syscall(__NR_io_uring_setup, entries, &p);
+  if (this->fd < 0)
+    return false;
+  // Multishot accepts and the buffer rings of 5.19 need these too
+  const uint32_t needed = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP |
+                          IORING_FEAT_SUBMIT_STABLE | IORING_FEAT_FAST_POLL;
+  if ((p.features & needed) != needed) {
+    this->close();
+    return false;
+  }
+
+  const ulong cqBytes = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+  this->sqBytes = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+  if (cqBytes > this->sqBytes)
+    this->sqBytes = cqBytes;
+  this->sqMemory = mmap(NULL, this->sqBytes, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, this->fd, IORING_OFF_SQ_RING);
+  this->sqesBytes = p.sq_entries * sizeof(io_uring_sqe);
+  this->sqes = (io_uring_sqe *)mmap(NULL, this->sqesBytes,
+                                    PROT_READ | PROT_WRITE,
+                                    MAP_SHARED | MAP_POPULATE, this->fd,
+                                    IORING_OFF_SQES);
+  if (this->sqMemory == MAP_FAILED || this->sqes == MAP_FAILED) {
+    this->close();
+    return false;
+  }
+  char *sq = (char *)this->sqMemory;
+  this->sqHead = (std::atomic<uint32_t> *)(sq + p.sq_off.head);
+  this->sqTail = (std::atomic<uint32_t> *)(sq + p.sq_off.tail);
+  this->sqMask = *(uint32_t *)(sq + p.sq_off.ring_mask);
+  this->sqArray = (uint32_t *)(sq + p.sq_off.array);
+  this->queued = 0;
+  this->failure = 0;
+  this->cqHead = (std::atomic<uint32_t> *)(sq + p.cq_off.head);
+  this->cqTail = (std::atomic<uint32_t> *)(sq + p.cq_off.tail);
+  this->cqMask = *(uint32_t *)(sq + p.cq_off.ring_mask);
+  this->cqes = (io_uring_cqe *)(sq + p.cq_off.cqes);
+
+  // The buffers and their ring, which starts on a page
+  this->bufferCount = count;
+  this->bufferSize = size;
+  this->buffersBytes = count * sizeof(io_uring_buf);
+  void *m = mmap(NULL, this->buffersBytes + (ulong)count * size,
+                 PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (m == MAP_FAILED) {
+    this->close();
+    return false;
+  }
+  this->buffers = (io_uring_buf *)m;
+  this->bufferMemory = (char *)m + this->buffersBytes;
+  io_uring_buf_reg r;
+  memset(&r, 0, sizeof(r));
+  r.ring_addr = (uint64_t)m;
+  r.ring_entries = count;
+  r.bgid = group;
+  if (syscall(__NR_io_uring_register, this->fd, IORING_REGISTER_PBUF_RING, &r,
+              1) < 0) {
+    this->close();
+    return false;
+  }
+  this->bufferTail = 0;
+  for (uint16_t id = 0; id < count; ++id)
+    this->recycle(id);
+
+  // Multishot receives came later, in 6.0. One from a socket with nothing
+  // more to send ends at once, failing with -EINVAL if they are not there.
+  int pair[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0) {
+    this->close();
+    return false;
+  }
+  shutdown(pair[1], SHUT_WR);
+  this->receive(pair[0], 0);
+  bool multishot = false;
+  if (this->submit())
+    this->each([this, &multishot](const io_uring_cqe &c) {
+      if (c.flags & IORING_CQE_F_BUFFER)
+        this->recycle(c.flags >> IORING_CQE_BUFFER_SHIFT);
+      multishot = c.res >= 0;
+    });
+  ::close(pair[0]);
+  ::close(pair[1]);
+  if (not multishot) {
+    this->close();
+    return false;
+  }
+  return true;
+}
+
+inline void calcUring::close() {
+  if (this->buffers != NULL)
+    munmap(this->buffers,
+           this->buffersBytes + (ulong)this->bufferCount * this->bufferSize);
+  this->buffers = NULL;
+  if (this->sqMemory != MAP_FAILED) {
+    munmap(this->sqMemory, this->sqBytes);
+    munmap(this->sqes, this->sqesBytes);
+  }
+  this->sqMemory = MAP_FAILED;
+  if (this->fd >= 0)
+    ::close(this->fd);
+  this->fd = -1;
+}
+
+// A request to fill, submitting those queued first until there is room. If
+// the kernel takes none, the request goes nowhere and submit() fails.
+inline io_uring_sqe *calcUring::next() {
+  const uint32_t tail = this->sqTail->load(std::memory_order_relaxed);
+  while (tail - this->sqHead->load(std::memory_order_acquire) > this->sqMask) {
+    const int n = enter(this->fd, this->queued, 0, 0);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      if (this->failure == 0)
+        this->failure = n < 0 ? errno : EBUSY;
+      return &this->spare;
+    }
+    this->queued -= n;
+  }
+  const uint32_t i = tail & this->sqMask;
+  io_uring_sqe *e = &this->sqes[i];
+  memset(e, 0, sizeof(*e));
+  this->sqArray[i] = i;
+  this->sqTail->store(tail + 1, std::memory_order_release);
+  ++this->queued;
+  return e;
+}
+
+inline void calcUring::accept(const int listener, const uint64_t data) {
+  io_uring_sqe *e = this->next();
+  e->opcode = IORING_OP_ACCEPT;
+  e->fd = listener;
+  e->ioprio = IORING_ACCEPT_MULTISHOT;
+  e->accept_flags = SOCK_NONBLOCK;
+  e->user_data = data;
+}
+
+inline void calcUring::receive(const int socket, const uint64_t data) {
+  io_uring_sqe *e = this->next();
+  e->opcode = IORING_OP_RECV;
+  e->fd = socket;
+  e->ioprio = IORING_RECV_MULTISHOT;
+  e->flags = IOSQE_BUFFER_SELECT;
+  e->buf_group = group;
+  e->user_data = data;
+}
+
+inline void calcUring::poll(const int fd, const uint32_t events,
+                            const uint64_t data) {
+  io_uring_sqe *e = this->next();
+  e->opcode = IORING_OP_POLL_ADD;
+  e->fd = fd;
+  e->len = IORING_POLL_ADD_MULTI;
+  e->poll32_events = events;
+  e->user_data = data;
+}
+
+inline void calcUring::send(const int socket, const msghdr *m,
+                            const uint64_t data) {
+  io_uring_sqe *e = this->next();
+  e->opcode = IORING_OP_SENDMSG;
+  e->fd = socket;
+  e->addr = (uint64_t)m;
+  e->msg_flags = MSG_NOSIGNAL;
+  e->user_data = data;
+}
+
+inline void calcUring::cancel(const uint64_t data) {
+  io_uring_sqe *e = this->next();
+  e->opcode = IORING_OP_ASYNC_CANCEL;
+  e->fd = -1;
+  e->addr = data;
+  // Its own completion says nothing worth knowing
+  e->user_data = 0;
+}
+
+inline void calcUring::timeout(const __kernel_timespec *t,
+                               const uint64_t data) {
+  io_uring_sqe *e = this->next();
+  e->opcode = IORING_OP_TIMEOUT;
+  e->fd = -1;
+  e->addr = (uint64_t)t;
+  e->len = 1;
+  e->user_data = data;
+}
+
+inline bool calcUring::submit() {
+  if (this->failure != 0) {
+    errno = this->failure;
+    return false;
+  }
+  const bool ready = this->cqHead->load(std::memory_order_relaxed) !=
+                     this->cqTail->load(std::memory_order_acquire);
+  const int n = enter(this->fd, this->queued, ready ? 0 : 1,
+                      ready ? 0 : IORING_ENTER_GETEVENTS);
+  if (n < 0)
+    return errno == EINTR || errno == EAGAIN || errno == EBUSY;
+  this->queued -= n;
+  return true;
+}
+
+template <typename F> void calcUring::each(F f) {
+  uint32_t head = this->cqHead->load(std::memory_order_relaxed);
+  const uint32_t tail = this->cqTail->load(std::memory_order_acquire);
+  for (; head != tail; ++head) {
+    const io_uring_cqe c = this->cqes[head & this->cqMask];
+    // Before f, which may queue requests completing in its place
+    this->cqHead->store(head + 1, std::memory_order_release);
+    f(c);
+  }
+}
+
+inline void calcUring::recycle(const uint16_t id) {
+  io_uring_buf &b = this->buffers[this->bufferTail & (this->bufferCount - 1)];
+  b.addr = (uint64_t)this->buffer(id);
+  b.len = this->bufferSize;
+  b.bid = id;
+  ++this->bufferTail;
+  // In the first entry, where it doesn't overlap the fields above
+  std::atomic<uint16_t> *tail = (std::atomic<uint16_t> *)&(
+      (io_uring_buf_ring *)this->buffers)->tail;
+  tail->store(this->bufferTail, std::memory_order_release);
+}
+
+#endif
+
+/*
+  Local Variables:
+  mode: c++
+  c-file-offset: 2
+  fill-column: 80
+  End:
+*/
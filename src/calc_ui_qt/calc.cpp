@@ -27,11 +27,13 @@ CalcUi::CalcUi(QWidget *parent)
 
 void CalcUi::on_buttonCalculate_clicked() {
   QString expression = lineEditInput->text().simplified();
-  try { // Parsing the expression
-    std::string in = expression.toStdString();
+  std::string in = expression.toStdString();
+  calcParse<float64_t> parser(context, in.c_str(), in.size());
+  const ERROR e = parser.tryParsing();
+  if (e.isSet()) {
+    qDebug() << expression << "Error: " << e.toString();
+  } else if (parser.hasAns()) { // Parsing the expression
     QString answer;
-    calcParse<float64_t> parser(in.c_str());
-    parser.startParsing();
     char ans[30];
     sprintf(ans, "%lg", parser.Ans());
     qDebug() << expression << "=" << parser.Ans();
@@ -45,11 +47,6 @@ void CalcUi::on_buttonCalculate_clicked() {
     outputTable->setItem(currentRow, 0, expressionItem);
     outputTable->setItem(currentRow, 1, answerItem);
     lineEditInput->clear();
-  } catch (ERROR *e) { // Catch any errors
-    if (e->isSet()) {
-      qDebug() << expression << "Error: " << e->toString();
-      delete e;
-    }
   }
 }
 
@@ -61,21 +58,20 @@ void CalcUi::on_lineEditInput_textChanged(QString expression)
   QString msg;
   if (not expression.isEmpty()) {
     std::string in = expression.toStdString();
-    try {
-      calcParse<float64_t> parser(in.c_str());
-      parser.storeAnswers = false;
-      parser.startParsing();
+    calcParse<float64_t> parser(context, in.c_str(), in.size());
+    parser.storeAnswers = false;
+    const ERROR e = parser.tryParsing();
+    if (e.isSet() || not parser.hasAns()) {
+      if (e.isSet()) {
+        QString err = "Error: ";
+        msg = err + e.toString();
+      }
+      buttonCalculate->setEnabled(false);
+    } else {
       char ans[30];
       sprintf(ans, "%lg", parser.Ans());
       msg = ans;
       buttonCalculate->setEnabled(true);
-    } catch (ERROR *e) {
-      if (e->isSet()) {
-        QString err = "Error: ";
-        msg = err + e->toString();
-      }
-      buttonCalculate->setEnabled(false);
-      delete e;
     }
   } else {
     msg = "Enter an expression";
@@ -3,6 +3,7 @@
 
 #include <QDialog>
 
+#include "calcContext.hpp"
 #include "ui_calc.h"
 
 class CalcUi : public QDialog, public Ui::CalcUi
@@ -10,6 +11,9 @@ class CalcUi : public QDialog, public Ui::CalcUi
   Q_OBJECT
 
 private:
+  // Answers of the expressions calculated so far
+  calcContext<float64_t> context;
+
   // Don't use lineEditInput->setText to insert text
   // Use this function instead
   void setLineEditInput(QString s)
@@ -6,8 +6,6 @@ int main(int argc, char **argv)
 {
   QApplication a(argc, argv);
 
-  makeOperatorHashes();
-
   CalcUi *calculatorWindow = new CalcUi;
 
   calculatorWindow->show();
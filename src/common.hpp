@@ -37,20 +37,9 @@ typedef str charPtr;
 #define NULL 0UL
 #endif
 
-const bool DONT_PRINT = 0;
-extern bool isQuiet;
-
-#define Printf(...) (isQuiet ? DONT_PRINT : printf(__VA_ARGS__))
-
-#define Println(...) {                          \
-    Printf(__VA_ARGS__);                        \
-    isQuiet ? DONT_PRINT :                      \
-      bool(std::cout << std::endl);             \
-  }
-
 #define println(...) {                          \
     printf(__VA_ARGS__);                        \
-    std::cout << std::endl;                     \
+    putchar('\n');                              \
   }
 
 #endif // CALC_COMMON_H
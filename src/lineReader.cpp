@@ -0,0 +1,127 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "lineReader.hpp"
+
+// Bytes read from a pipe at once
+static const ulong readSize = 1 << 20;
+
+lineReader::lineReader()
+    : fd(-1), ownFd(false), data(NULL), size(0), buf(NULL), capacity(0),
+      begin(0), filled(0), eof(false) {}
+
+lineReader::~lineReader() {
+  if (this->data)
+    munmap(this->data, this->size);
+  free(this->buf);
+  if (this->ownFd)
+    close(this->fd);
+}
+
+bool lineReader::open(constStr path) {
+  if (strcmp(path, "-") == 0) {
+    this->open(STDIN_FILENO);
+    return true;
+  }
+  int f = ::open(path, O_RDONLY);
+  if (f < 0)
+    return false;
+  struct stat s;
+  if (fstat(f, &s) != 0 || S_ISDIR(s.st_mode)) {
+    close(f);
+    return false;
+  }
+  this->open(f);
+  this->ownFd = true;
+  return true;
+}
+
+void lineReader::open(int f) {
+  this->fd = f;
+  struct stat s;
+  if (fstat(f, &s) != 0 || not S_ISREG(s.st_mode) || s.st_size == 0)
+    return;
+  void *m = mmap(NULL, s.st_size, PROT_READ, MAP_PRIVATE, f, 0);
+  if (m == MAP_FAILED)
+    return;
+  madvise(m, s.st_size, MADV_SEQUENTIAL);
+  this->data = (str)m;
+  this->size = s.st_size;
+}
+
+bool lineReader::fill() {
+  // Move the partial line to the front and make room for a full read
+  if (this->begin) {
+    memmove(this->buf, this->buf + this->begin, this->filled - this->begin);
+    this->filled -= this->begin;
+    this->begin = 0;
+  }
+  if (this->capacity - this->filled < readSize) {
+    ulong c = this->capacity ? this->capacity * 2 : readSize;
+    while (c - this->filled < readSize)
+      c *= 2;
+    str b = (str)realloc(this->buf, c);
+    if (b == NULL) {
+      this->eof = true;
+      return false;
+    }
+    this->buf = b;
+    this->capacity = c;
+  }
+  ssize_t n;
+  do
+    n = read(this->fd, this->buf + this->filled, this->capacity - this->filled);
+  while (n < 0 && errno == EINTR);
+  if (n <= 0) {
+    this->eof = true;
+    return false;
+  }
+  this->filled += n;
+  return true;
+}
+
+bool lineReader::nextBlock(constStr &start, constStr &end) {
+  if (this->data) {
+    // The whole mapping is one block
+    if (this->eof)
+      return false;
+    this->eof = true;
+    start = this->data;
+    end = this->data + this->size;
+    return true;
+  }
+  if (this->fd < 0)
+    return false;
+
+  while (true) {
+    constStr from = this->buf + this->begin, to = this->buf + this->filled;
+    // Last newline of what is buffered
+    constStr nl = to > from ? (constStr)memrchr(from, '\n', to - from) : NULL;
+    if (nl || (this->eof && to > from)) {
+      start = from;
+      end = nl ? nl + 1 : to;
+      this->begin = end - this->buf;
+      return true;
+    }
+    if (this->eof || not this->fill())
+      if (this->filled == this->begin)
+        return false;
+  }
+}
+
+void lineReader::nextLine(constStr &start, constStr end, ulong &len) {
+  // memchr() is vectorized by the C library
+  constStr nl = (constStr)memchr(start, '\n', end - start);
+  if (nl == NULL) {
+    len = end - start;
+    start = end;
+  } else {
+    len = nl - start;
+    start = nl + 1;
+  }
+}
@@ -0,0 +1,37 @@
+#ifndef LINE_READER_HPP
+#define LINE_READER_HPP
+
+#include "common.hpp"
+
+// Reads a file a block of whole lines at a time without copying the lines.
+// Regular files are mapped into memory and given as one block. Pipes and
+// terminals are read into a buffer which grows as needed, so a line can be of
+// any length.
+class lineReader {
+  int fd;
+  bool ownFd;
+  // The mapped file
+  str data;
+  ulong size;
+  // Buffer for files which can't be mapped. [begin, filled) is yet to be given.
+  str buf;
+  ulong capacity, begin, filled;
+  bool eof;
+
+  bool fill();
+
+public:
+  lineReader();
+  ~lineReader();
+  // Open a file or stdin for "-". False if it can't be read.
+  bool open(constStr);
+  // Read from an already open file descriptor
+  void open(int);
+  // Give the next block. It ends just after a newline or at the end of the
+  // file and is valid until the next call. False at the end of the file.
+  bool nextBlock(constStr &, constStr &);
+  // Split off the line at start, which is moved to the next one
+  static void nextLine(constStr &start, constStr end, ulong &len);
+};
+
+#endif
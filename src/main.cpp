@@ -1,11 +1,13 @@
 #include <stdio.h>
+#include <sys/stat.h>
 #include <unistd.h>
-#include <fstream>
 #include <readline/history.h>
 #include <readline/readline.h>
 
+#include "calcBatch.hpp"
 #include "calcParser.hpp"
 #include "input_bindings.hpp"
+#include "lineReader.hpp"
 
 /* Name of the executable. It should be set in main() */
 constStr progName = NULL;
@@ -23,9 +25,24 @@ size_t progArgsCount = 0;
 char prompt[500] = ">> ";
 
 
-/* Should we design the output?
-   If its true then we just print the end result */
-bool isQuiet = false;
+/* Options changing the output */
+struct cliOptions {
+  /* Should we design the output?
+     If its true then we just print the end result */
+  bool quiet = false;
+
+  /* Need a JSON output? Just use ‘-j’ flag */
+  bool JSON = false;
+} options;
+
+
+/* Answers and angle unit of the session */
+calcContext<float64_t> session;
+
+
+const bool DONT_PRINT = 0;
+
+#define Printf(...) (options.quiet ? DONT_PRINT : printf(__VA_ARGS__))
 
 
 /* if true print to stdout instead of stderr */
@@ -35,8 +52,13 @@ FILE* useOut4Err = stderr;
 bool quit = false;
 
 
-/* Need a JSON output? Just use ‘-j’ flag */
-bool JSONoutput = false;
+/* Number of threads evaluating a file given with ‘-f’. 0 uses every core. */
+uint threads = 0;
+const long maxThreads = 1024;
+
+
+/* Lines of a file evaluated together */
+const ulong batchSize = 1 << 14;
 
 
 /* The welcome message in the CLI */
@@ -46,28 +68,78 @@ constStr welcomeMessage = {
 
 
 
-inline void execute(constStr input) {
-  try { // Parsing the input
-    calcParse<float64_t> parser(input);
-    parser.startParsing();
-    if (JSONoutput == true) {
-      printf("{ \"ans\": %lf }", parser.Ans());
+inline void printResult(const ERROR &e, const bool hasAns, const float64_t ans) {
+  if (e.isSet()) {
+    if (options.JSON == true) {
+      println("{ \"error\": \"%s\" }", e.toString());
+    } else {
+      if (not options.quiet)
+        fprintf(useOut4Err, "\n");
+      fprintf(useOut4Err, "Error: %s\n", e.toString());
+    }
+  } else if (hasAns) {
+    char buf[32];
+    numToStr(ans, buf);
+    if (options.JSON == true) {
+      // JSON has no infinity or NaN
+      printf("{ \"ans\": %s }\n", isfinite(ans) ? buf : "null");
     } else {
       Printf(" = ");
-      printf("%lg", parser.Ans());
+      fputs(buf, stdout);
+      putchar('\n');
     }
-    std::cout << std::endl;
-  } catch (ERROR *e) { // Catch any errors
-    if (e->isSet()) {
-      if (JSONoutput == true) {
-        println("{ \"error\": \"%s\" }", e->toString());
-      } else {
-        if (not isQuiet)
-          fprintf(useOut4Err, "\n");
-        fprintf(useOut4Err, "Error: %s\n", e->toString());
+  }
+}
+
+
+
+/* Write the answers to the file given with ‘-a’ */
+inline void flushAnswers() {
+  const ERROR e = session.answers.flush();
+  if (e.isSet())
+    fprintf(useOut4Err, "Error: %s\n", e.toString());
+}
+
+
+
+inline void execute(constStr input, const ulong len) {
+  calcParse<float64_t> parser(session, input, len);
+  const ERROR e = parser.tryParsing();
+  printResult(e, parser.hasAns(), parser.Ans());
+}
+
+
+
+/* Evaluate a file batchSize lines at a time. Lines of a batch are evaluated in
+   parallel, except the ones referring to answers, and printed in order. The
+   lines are read in place from the reader's blocks. */
+void executeFile(lineReader &f) {
+  calcBatch<float64_t> pool(threads);
+  std::vector<calcBatch<float64_t>::line> lines;
+  constStr start, end;
+
+  while (f.nextBlock(start, end)) {
+    while (start < end) {
+      lines.clear();
+      while (lines.size() < batchSize && start < end) {
+        calcBatch<float64_t>::line l = {start, 0, false, ERROR(), false, 0};
+        lineReader::nextLine(start, end, l.len);
+        lines.push_back(l);
       }
+
+      pool.evaluate(lines, session);
+
+      for (const calcBatch<float64_t>::line &l : lines) {
+        Printf(">> %.*s", (int)l.len, l.text);
+        if (l.dependent) {
+          execute(l.text, l.len);
+        } else {
+          const ERROR e = l.hasAns ? session.answers.tryPush(l.ans) : l.e;
+          printResult(e, l.hasAns && not e.isSet(), l.ans);
+        }
+      }
+      flushAnswers();
     }
-    delete e;
   }
 }
 
@@ -75,19 +147,68 @@ inline void execute(constStr input) {
 
 int main(int argc, str argv[]) {
 
-  // TODO: Make an init function if main() becomes bulky
-  makeOperatorHashes();
-
   progName = *argv;
   progArgs = (constStr *)argv + 1;
   progArgsCount = argc;
 
+  // Answers are written a block at a time unless someone is watching. Then
+  // stdout is flushed before each prompt and at exit.
+  if (not isatty(STDOUT_FILENO))
+    setvbuf(stdout, NULL, _IOFBF, 1 << 16);
+
+  // Long sessions keep only the latest answers in memory, 64K of them unless
+  // ‘-m’ says otherwise. Older ones are compressed into a temporary file.
+  ulong hotAnswers = 1 << 16;
+
+  // Errors going to the same file as answers go through the same buffer to
+  // stay in order
+  struct stat out, err;
+  if (fstat(STDOUT_FILENO, &out) == 0 && fstat(STDERR_FILENO, &err) == 0 &&
+      out.st_dev == err.st_dev && out.st_ino == err.st_ino)
+    useOut4Err = stdout;
+
+  // ‘-t’ and ‘-m’ count for every ‘-f’ wherever they are given, so they are
+  // read first
+  opterr = 0;
+  for (int option; (option = getopt(argc, argv, "a:ce:f:jm:qst:")) != -1;) {
+    if (option != 't' && option != 'm')
+      continue;
+    str end;
+    const long n = strtol(optarg, &end, 10);
+    if (*optarg == '\0' || *end != '\0' || n < 1 ||
+        (option == 't' && n > maxThreads)) {
+      if (option == 't') {
+        println("'%s' is not a number of threads from 1 to %ld", optarg,
+                maxThreads);
+      } else {
+        println("'%s' is not a number of answers", optarg);
+      }
+      exit(-1);
+    }
+    if (option == 't')
+      threads = n;
+    else
+      hotAnswers = n;
+  }
+  opterr = 1;
+  optind = 1;
+  const ulong perChunk = session.answers.chunkSize();
+  session.answers.spill((hotAnswers + perChunk - 1) / perChunk);
+
   // Processing Shell Arguments
   while (true) {
-    char option = getopt(argc, argv, "ce:f:jqs");
+    char option = getopt(argc, argv, "a:ce:f:jm:qst:");
     if (option == -1)
       break;
     switch (option) {
+    case 'a': {
+      const ERROR e = session.answers.attach(optarg);
+      if (e.isSet()) {
+        println("'%s' can't be used for answers: %s", optarg, e.toString());
+        exit(-1);
+      }
+      break;
+    }
     case 's':
       useOut4Err = stdout;
       break;
@@ -96,37 +217,43 @@ int main(int argc, str argv[]) {
       break;
     case 'e':
       Printf(">> %s", optarg);
-      execute(optarg);
+      execute(optarg, strlen(optarg));
+      flushAnswers();
       break;
     case 'f': {
-      // Use optarg as filename
-      std::ifstream f(optarg);
-      if (f.is_open()) {
-        char input[32768];
-        while (not f.eof()) {
-          f.getline(input, 32767);
-          Printf(">> %s", input);
-          execute(input);
-        }
-        f.close();
+      // Use optarg as filename or "-" for stdin
+      lineReader f;
+      if (f.open(optarg)) {
+        executeFile(f);
       } else {
         println("'%s' is not a file", optarg);
         exit(-1);
       }
       break;
     }
+    case 't':
+    case 'm':
+      break;
     case 'q':
-      isQuiet = true;
+      options.quiet = true;
       strcpy(prompt, "");
       break;
     case 'j':
-      JSONoutput = true;
+      options.JSON = true;
       break;
     }
   }
   if (quit == true)
     exit(0);
 
+  // Expressions piped in are evaluated like a file
+  if (not isatty(STDIN_FILENO)) {
+    lineReader f;
+    f.open(STDIN_FILENO);
+    executeFile(f);
+    exit(0);
+  }
+
   Printf("%s", welcomeMessage);
 
   str input = nullptr;
@@ -140,6 +267,7 @@ int main(int argc, str argv[]) {
     free(input);
 
   // Using the GNU Readline library to take input
+  fflush(stdout);
   input = readline(prompt);
 
   // Quit if there is an EOF or "exit" as an input
@@ -151,7 +279,8 @@ int main(int argc, str argv[]) {
   // Add to GNU Readline history to access it using up arrow and C-r
   add_history(input);
 
-  execute(input);
+  execute(input, strlen(input));
+  flushAnswers();
 
   goto take_input;
 }
@@ -1,6 +1,9 @@
 #include "common.hpp"
+#include "str.hpp"
 #include <ctype.h>
 #include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
 
 #if !defined(_STRING_H) && !defined(STRING_H) && !defined(_STRING_H_)
 uint64_t strlen(constStr s) {
@@ -80,41 +83,111 @@ bool isidentifier(constStr s) {
 }
 
 uint64_t strToNum(constStr *a, double &x, datatype d) {
-  bool sign = 0;
-  constStr c = *a, s = *a;
-  bool flag = 0;
-  if (*c == '+' || *c == '-') {
-    if (*c == '-') {
-      if (d == REAL || d == INT)
-        sign = 1;
-      else
-        // for unsigned numbers
-        return 0;
+  return strToNum(a, *a + strlen(*a), x, d);
+}
+
+uint numToStr(double x, str buf) {
+  // Fixed notation which "%g" also uses for these numbers. Try the least
+  // number of decimals first. m / 10^k is correctly rounded just like strtod()
+  // reading it, so it is equal to x only if the text reads back as x.
+  const double ax = fabs(x);
+  if (ax >= 1e-4 && ax < 1e15) {
+    double p = 1;
+    for (uint k = 0; k <= 22; ++k, p *= 10) {
+      const double m = nearbyint(ax * p);
+      if (m >= 9007199254740992.0) // 2^53
+        break;
+      if (m / p != ax)
+        continue;
+      char digits[24];
+      uint n = 0, len = 0;
+      for (ull d = m; d; d /= 10)
+        digits[n++] = '0' + d % 10;
+      if (x < 0)
+        buf[len++] = '-';
+      if (n <= k) {
+        buf[len++] = '0';
+        buf[len++] = '.';
+        for (uint z = n; z < k; ++z)
+          buf[len++] = '0';
+      }
+      while (n) {
+        buf[len++] = digits[--n];
+        if (n && n == k)
+          buf[len++] = '.';
+      }
+      buf[len] = '\0';
+      return len;
     }
-    ++c;
   }
-  if (isdigit(*c)) {
-    // Integral Part
-    while (isdigit(*c))
-      x = x * 10 + *(c++) - 48;
-    flag = 1;
-  }
-  if (*c == '.' && isdigit(c[1])) {
-    // Fraction part
-    if (d != REAL && d != UREAL)
-      return 0;
-    slong j = 0;
-    while (*(++c) > 47 && *c < 58) // isdigit
-      x = x + powl(10, --j) * (*c - 48);
-    flag = 1;
+  // Exponents, zero, infinity and the rest
+  if (not isfinite(x) || x == 0)
+    return snprintf(buf, 32, "%g", x);
+  // Any decimal of up to 15 digits reads back as a different number, so if
+  // one of them reads back as x it's what "%.15g" writes. With more digits
+  // only the closest decimals to x on either side can be it.
+  for (int precision = fpclassify(x) == FP_SUBNORMAL ? 1 : 15; precision <= 17;
+       ++precision) {
+    char e[48], digits[20];
+    snprintf(e, sizeof(e), "%.*e", precision - 1, x);
+    // The digits without the sign and the point, then the exponent
+    constStr c = e;
+    uint n = 0;
+    for (; *c != 'e'; ++c)
+      if (isdigit(*c))
+        digits[n++] = *c;
+    digits[n] = '\0';
+    const int exponent = strtol(c + 1, NULL, 10);
+    double y = strtod(e, NULL);
+    if (y != x && fabs(y) < fabs(x)) {
+      // Powers of 2 are closer to the number below them than to the one
+      // above. The closest decimal may be too far below while the one above
+      // still reads back as x.
+      int i = n - 1;
+      for (; i >= 0 && digits[i] == '9'; --i)
+        digits[i] = '0';
+      // Fewer digits would have done then
+      if (i < 0)
+        continue;
+      ++digits[i];
+      snprintf(e, sizeof(e), "%s%se%d", x < 0 ? "-" : "", digits,
+               exponent - (int)n + 1);
+      y = strtod(e, NULL);
+    }
+    if (y != x)
+      continue;
+    // Written as "%g" would, without trailing zeros
+    while (n > 1 && digits[n - 1] == '0')
+      --n;
+    uint len = 0;
+    if (x < 0)
+      buf[len++] = '-';
+    if (exponent < -4 || exponent >= precision) {
+      buf[len++] = digits[0];
+      if (n > 1)
+        buf[len++] = '.';
+      for (uint i = 1; i < n; ++i)
+        buf[len++] = digits[i];
+      len += sprintf(buf + len, "e%c%02d", exponent < 0 ? '-' : '+',
+                     abs(exponent));
+    } else if (exponent < 0) {
+      buf[len++] = '0';
+      buf[len++] = '.';
+      for (int z = exponent + 1; z < 0; ++z)
+        buf[len++] = '0';
+      for (uint i = 0; i < n; ++i)
+        buf[len++] = digits[i];
+    } else {
+      for (uint i = 0; i < n || (int)i <= exponent; ++i) {
+        if ((int)i == exponent + 1)
+          buf[len++] = '.';
+        buf[len++] = i < n ? digits[i] : '0';
+      }
+    }
+    buf[len] = '\0';
+    return len;
   }
-  //  if ((*c == '.' && !isdigit(c[1])) || s == c)
-    //    return 0;
-  if (not flag)
-    return 0;
-  *a = c;
-  x = sign ? -x : x;
-  return c - s; // The length that was converted
+  return 0;
 }
 
 #ifdef ANS_CMD
@@ -141,7 +214,7 @@ void extract(constStr a, str b, ulong i, ulong j, char ch, ulong len) {
 }
 
 str trimSpaces(constStr s) {
-  str modStr = new char[strlen(s)];
+  str modStr = new char[strlen(s) + 1];
   int i = 0, j = 0;
 
   while (isspace(s[i]))
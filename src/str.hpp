@@ -2,7 +2,11 @@
 #define CALC_STR_H
 
 #include "common.hpp"
+#include <algorithm>
+#include <cmath>
 #include <ctype.h>
+#include <limits>
+#include <stdlib.h>
 
 inline void skipSpace(constStr s, ulong &i) {
   isspace(s[i]) ? ++i : i;
@@ -26,7 +30,173 @@ extern char* strncat(str s1, constStr s2, uint64_t l);
 
 extern bool isidentifier(constStr s);
 
-extern signed char strToNum(constStr *a, double &x, datatype d);
+extern uint64_t strToNum(constStr *a, double &x, datatype d);
+
+// Converts a NUL terminated decimal literal with the strto*() of the type
+inline void decToNum(constStr s, float32_t &x) { x = strtof(s, NULL); }
+inline void decToNum(constStr s, float64_t &x) { x = strtod(s, NULL); }
+inline void decToNum(constStr s, float128_t &x) { x = strtold(s, NULL); }
+template <typename numT> void decToNum(constStr s, numT &x) {
+  x = numT(strtold(s, NULL));
+}
+
+// Largest power of 10 which numT holds exactly. 10^e is exact while 5^e fits
+// in the mantissa.
+template <typename numT>
+constexpr sint exactPow10(sint e = 0, ull p = 1,
+                          sint bits = std::numeric_limits<numT>::digits) {
+  return bits > 0 && p <= (~0ULL >> (64 - std::min(bits, 64))) / 5
+             ? exactPow10<numT>(e + 1, p * 5, bits)
+             : e;
+}
+
+// Reads a number literal starting at *a and never reads at or beyond end. *a
+// is moved past the literal and its length is returned, which is 0 if there
+// was no number. Accepted are an optional sign, decimal numbers with a
+// fraction and an exponent(1.5e-9) and the integers 0x1f, 0o17 and 0b101.
+// Fractions and exponents are only read for REAL and UREAL and a sign is
+// rejected for the unsigned types.
+//
+// Decimal literals of up to 19 significant digits whose mantissa and power of
+// 10 are both exact in numT are calculated with a single multiplication or
+// division, which is correctly rounded. The rest go through strto*().
+template <typename numT>
+uint64_t strToNum(constStr *a, constStr end, numT &x, datatype d) {
+  constStr c = *a, s = *a;
+  bool sign = false;
+  const bool real = d == REAL || d == UREAL;
+
+  if (c < end && (*c == '+' || *c == '-')) {
+    if (*c == '-') {
+      if (d == UREAL || d == UINT)
+        return 0;
+      sign = true;
+    }
+    ++c;
+  }
+  constStr digits = c;
+
+  // Radix integers
+  if (end - c > 2 && *c == '0') {
+    uint shift = tolower(c[1]) == 'x' ? 4 : tolower(c[1]) == 'o' ? 3
+               : tolower(c[1]) == 'b' ? 1 : 0;
+    auto value = [shift](char ch) -> sint {
+      sint v = isdigit(ch) ? ch - '0'
+               : isxdigit(ch) ? tolower(ch) - 'a' + 10 : 16;
+      return v < (1 << shift) ? v : -1;
+    };
+    if (shift && value(c[2]) >= 0) {
+      // The first 64 bits go to m. Of the ones after them, only the first
+      // one(half) and whether any other is set(sticky) matter for rounding.
+      ull m = 0;
+      sint lost = 0;
+      bool half = false, sticky = false;
+      for (c += 2; c < end && value(*c) >= 0; ++c) {
+        const ull v = value(*c);
+        const sint fit = std::min<sint>(m ? __builtin_clzll(m) : 64, shift);
+        const sint rest = shift - fit;
+        m = m << fit | v >> rest;
+        if (rest) {
+          const ull low = v & ((1ULL << rest) - 1);
+          if (lost == 0) {
+            half = low >> (rest - 1);
+            sticky = low & ((1ULL << (rest - 1)) - 1);
+          } else
+            sticky = sticky || low;
+          lost += rest;
+        }
+      }
+      // Round to the digits of numT, to nearest with ties to even
+      const sint excess =
+          (m ? 64 - __builtin_clzll(m) : 0) - std::numeric_limits<numT>::digits;
+      if (excess > 0) {
+        const ull low = m & ((1ULL << excess) - 1);
+        sticky = sticky || half || (low & ((1ULL << (excess - 1)) - 1));
+        half = low >> (excess - 1);
+        m >>= excess;
+        lost += excess;
+      }
+      if (half && (sticky || (m & 1)) && ++m == 0) {
+        m = 1ULL << 63;
+        ++lost;
+      }
+      x = std::ldexp(numT(m), lost);
+      x = sign ? -x : x;
+      *a = c;
+      return c - s;
+    }
+  }
+
+  ull m = 0;
+  sint e = 0, sigDigits = 0;
+  bool flag = false, exact = true;
+  for (; c < end && isdigit(*c); ++c, flag = true) {
+    if (sigDigits < 19) {
+      m = m * 10 + (*c - '0');
+      sigDigits += m != 0;
+    } else {
+      ++e;
+      exact = false;
+    }
+  }
+  if (end - c > 1 && *c == '.' && isdigit(c[1])) {
+    if (not real)
+      return 0;
+    for (++c; c < end && isdigit(*c); ++c) {
+      if (sigDigits < 19) {
+        m = m * 10 + (*c - '0');
+        sigDigits += m != 0;
+        --e;
+      } else
+        exact = false;
+    }
+    flag = true;
+  }
+  if (not flag)
+    return 0;
+
+  // The exponent is only taken when digits follow it
+  if (real && c < end && tolower(*c) == 'e') {
+    constStr p = c + 1;
+    bool negExp = false;
+    if (p < end && (*p == '+' || *p == '-'))
+      negExp = *p++ == '-';
+    if (p < end && isdigit(*p)) {
+      sint exp = 0;
+      for (; p < end && isdigit(*p); ++p)
+        exp = exp < 100000 ? exp * 10 + (*p - '0') : exp;
+      e += negExp ? -exp : exp;
+      c = p;
+    }
+  }
+
+  const sint maxExp = exactPow10<numT>();
+  if (exact && m >> std::min(std::numeric_limits<numT>::digits, 63) == 0 &&
+      e >= -maxExp && e <= maxExp) {
+    numT p = 1;
+    for (sint i = e < 0 ? -e : e; i--;)
+      p *= 10;
+    x = e < 0 ? numT(m) / p : numT(m) * p;
+  } else {
+    // strto*() needs the literal NUL terminated
+    char local[64];
+    str buf = c - digits < 64 ? local : new char[c - digits + 1];
+    for (constStr i = digits; i < c; ++i)
+      buf[i - digits] = *i;
+    buf[c - digits] = '\0';
+    decToNum(buf, x);
+    if (buf != local)
+      delete[] buf;
+  }
+  x = sign ? -x : x;
+  *a = c;
+  return c - s; // The length that was converted
+}
+
+// Writes the shortest text which strtod() reads back as x, in the notation of
+// "%g". Of the decimals with that few digits, the closest to x is taken. buf
+// needs room for 32 characters. The length written is returned.
+extern uint numToStr(double x, str buf);
 
 extern str trimSpaces(constStr s);
 
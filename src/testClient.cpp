@@ -1,61 +1,146 @@
+#include <chrono>
+#include <cmath>
+#include <iostream>
 #include <stdio.h>
 #include <stdlib.h>
-#include <unistd.h>
 #include <string.h>
-#include <sys/types.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <netdb.h>
-#include <errno.h>
+#include <unistd.h>
+#include <vector>
 
-void error(const char *msg)
-{
-  printf("%d", errno);
-  perror(msg);
-  exit(0);
+#include "calcClient.hpp"
+#include "str.hpp"
+
+// Sends the lines of stdin to calcServer and prints the replies. Through
+// shared memory PREPARE and EXEC are understood here, with the values of EXEC
+// given in the order of the variables:
+//   PREPARE f a*x^2+b*x
+//   EXEC f 1,3,2
+static void usage(constStr name) {
+  fprintf(stderr,
+          "usage %s [-n <times>] [-l] hostname port\n"
+          "      %s [-n <times>] [-l | -m] -u <unix socket>\n"
+          "  -m  talk through shared memory\n"
+          "  -n  ask every line that many times and print how long it took\n"
+          "  -l  send the lines, or each of them that many times, and leave\n"
+          "      after the first reply\n",
+          name, name);
+  exit(1);
+}
+
+// Like the replies of calcServer
+static void print(const calcClient::result &r) {
+  char number[32];
+  if (r.e.isSet() && r.hasPosition) {
+    printf("{ \"error\": \"%s\", \"position\": %lu }\n", r.e.toString(),
+           r.position);
+  } else if (r.e.isSet()) {
+    printf("{ \"error\": \"%s\" }\n", r.e.toString());
+  } else if (r.hasAns) {
+    numToStr(r.ans, number);
+    printf("{ \"ans\": %s }\n", std::isfinite(r.ans) ? number : "null");
+  } else {
+    printf("{ }\n");
+  }
+}
+
+// Ask a line through shared memory
+static bool askShared(calcClient &client, const std::string &line,
+                      calcClient::result &r) {
+  if (line.compare(0, 8, "PREPARE ") == 0) {
+    const ulong space = line.find(' ', 8);
+    if (space == std::string::npos)
+      return client.prepare(line.substr(8), "", r);
+    return client.prepare(line.substr(8, space - 8), line.substr(space + 1), r);
+  }
+  if (line.compare(0, 5, "EXEC ") == 0) {
+    ulong space = line.find(' ', 5);
+    const std::string id = line.substr(5, space - 5);
+    std::vector<float64_t> values;
+    while (space != std::string::npos && space + 1 < line.size()) {
+      values.push_back(strtod(line.c_str() + space + 1, NULL));
+      space = line.find(',', space + 1);
+    }
+    return client.exec(id, values.data(), values.size(), r);
+  }
+  return client.evaluate(line, r);
 }
 
 int main(int argc, char *argv[])
 {
-  int sockfd, portno, n;
-  struct sockaddr_in serv_addr;
-  struct hostent *server;
+  constStr path = NULL;
+  bool shared = false, leave = false;
+  ulong times = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "lmn:u:")) != -1) {
+    if (opt == 'l')
+      leave = true;
+    else if (opt == 'm')
+      shared = true;
+    else if (opt == 'n')
+      times = strtoul(optarg, NULL, 10);
+    else if (opt == 'u')
+      path = optarg;
+    else
+      usage(argv[0]);
+  }
+  if (leave && shared)
+    usage(argv[0]);
+
+  calcClient client;
+  if (path != NULL) {
+    if (not client.connect(path)) {
+      perror("ERROR connecting");
+      return 1;
+    }
+  } else {
+    if (argc - optind < 2 || shared)
+      usage(argv[0]);
+    if (not client.connect(argv[optind], atoi(argv[optind + 1]))) {
+      fprintf(stderr, "ERROR connecting to %s\n", argv[optind]);
+      return 1;
+    }
+  }
+  if (shared && not client.attach()) {
+    fprintf(stderr, "ERROR, the server didn't take shared memory\n");
+    return 1;
+  }
 
-  char buffer[256];
-  if (argc < 3) {
-    fprintf(stderr,"usage %s hostname port\n", argv[0]);
-    exit(0);
-  }
-  portno = atoi(argv[2]);
-  sockfd = socket(AF_INET, SOCK_STREAM, 0);
-  if (sockfd < 0)
-    error("ERROR opening socket");
-  server = gethostbyname(argv[1]);
-  if (server == NULL) {
-    fprintf(stderr,"ERROR, no such host\n");
-    exit(0);
-  }
-  memset((char *) &serv_addr, 0, sizeof(serv_addr));
-  serv_addr.sin_family = AF_INET;
-  bcopy((char *)server->h_addr,
-        (char *)&serv_addr.sin_addr.s_addr,
-        server->h_length);
-  serv_addr.sin_port = htons(portno);
-  if (connect(sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0)
-    error("ERROR connecting");
-  printf("Please enter the message: ");
-  bzero(buffer,256);
-  fgets(buffer,255,stdin);
-  printf("'%s'\n", buffer);
-  printf("n = %d\n", n);
-  n = write(sockfd, buffer, strlen(buffer) + 1);
-  if (n <= 0)
-    error("ERROR writing to socket");
-  memset(buffer, 0, 256);
-  n = read(sockfd, buffer, 255);
-  if (n <= 0)
-    error("ERROR reading from socket");
-  printf("%s\n", buffer);
-  close(sockfd);
+  std::string line, reply;
+  calcClient::result r;
+  // Like a client gone before reading its replies, which the server has to
+  // survive
+  if (leave) {
+    while (std::getline(std::cin, line))
+      for (ulong i = 0; i < (times ? times : 1); ++i)
+        if (not client.send(line)) {
+          fprintf(stderr, "ERROR, the server is gone\n");
+          return 1;
+        }
+    if (not client.finish() || not client.receive(reply)) {
+      fprintf(stderr, "ERROR, the server is gone\n");
+      return 1;
+    }
+    return 0;
+  }
+  while (std::getline(std::cin, line)) {
+    auto begin = std::chrono::steady_clock::now();
+    for (ulong i = 0; i < (times ? times : 1); ++i) {
+      const bool ok = shared ? askShared(client, line, r)
+                             : client.ask(line, reply);
+      if (not ok) {
+        fprintf(stderr, "ERROR, the server is gone\n");
+        return 1;
+      }
+    }
+    auto end = std::chrono::steady_clock::now();
+    if (shared)
+      print(r);
+    else
+      printf("%s\n", reply.c_str());
+    if (times)
+      fprintf(stderr, "%.0f ns per request\n",
+              std::chrono::duration<double, std::nano>(end - begin).count() /
+                  times);
+  }
   return 0;
 }
@@ -0,0 +1,50 @@
+#!/bin/bash
+# Drives calcServer over TCP with each engine and with shards. The requests of
+# serverTests.input go pipelined on one connection and their replies have to
+# be serverTests.output. Then testClient -l sends many requests and leaves
+# without reading the replies, and the server has to go on answering the same.
+
+server=${SERVER:-./src/calcServer}
+client=${CLIENT:-./src/testClient}
+port=${PORT:-4807}
+
+check()
+{
+        output=$(mktemp)
+        $server -l off "$@" $port > /dev/null &
+        pid=$!
+        for i in $(seq 50); do
+                (exec 3<>/dev/tcp/127.0.0.1/$port) 2>/dev/null && break
+                sleep 0.1
+        done
+
+        exec 3<>/dev/tcp/127.0.0.1/$port
+        cat tests/serverTests.input >&3
+        timeout 10 cat <&3 > $output
+        exec 3<&-
+
+        # Gone before reading its replies, which used to kill the server with
+        # SIGPIPE
+        for i in 1 2 3; do
+                echo '1+2*3' | $client -l -n 60000 127.0.0.1 $port
+        done
+
+        exec 3<>/dev/tcp/127.0.0.1/$port
+        cat tests/serverTests.input >&3
+        timeout 10 cat <&3 >> $output
+        exec 3<&-
+
+        kill -INT $pid
+        wait $pid 2>/dev/null
+        if diff $output <(cat tests/serverTests.output tests/serverTests.output)
+        then
+	        echo tests passed
+        else
+	        echo tests failed
+        fi
+        rm $output
+}
+
+check -e epoll
+check -e uring
+check -r 2